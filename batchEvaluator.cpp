@@ -0,0 +1,347 @@
+#include "batchEvaluator.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+// Rows evaluated together; a block's columns stay in cache.
+constexpr size_t blockRows = 1024;
+
+struct Group {
+  std::vector<Token> shape;     // Postfix tokens of the first member.
+  size_t width = 0;             // Number literals per member.
+  std::vector<double> literals; // Row-major, 'width' per member.
+  std::vector<size_t> members;  // Input indices.
+};
+
+// One stack entry: a column of values and, if any row failed, a column of
+// error codes (0 for rows that did not fail).
+struct Column {
+  const double *values;
+  const std::uint32_t *errors;
+};
+
+// Error messages by code; code 0 means no error.
+class ErrorTable {
+public:
+  std::uint32_t code(const std::string &message) {
+    auto it = std::find(messages.begin(), messages.end(), message);
+    if (it == messages.end())
+      it = messages.insert(messages.end(), message);
+    return static_cast<std::uint32_t>(it - messages.begin()) + 1;
+  }
+  const std::string &message(std::uint32_t code) const { return messages[code - 1]; }
+
+private:
+  std::vector<std::string> messages;
+};
+
+// The switch is outside the loops, so each loop is a straight pass over
+// the columns.
+void applyColumns(OperatorKind kind, const double *a, const double *b, double *out, size_t rows) {
+  switch (kind) {
+  case OperatorKind::Add:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = a[r] + b[r];
+    break;
+  case OperatorKind::Subtract:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = a[r] - b[r];
+    break;
+  case OperatorKind::Multiply:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = a[r] * b[r];
+    break;
+  case OperatorKind::Divide: // Zero divisors are flagged by the caller.
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = a[r] / b[r];
+    break;
+  case OperatorKind::Power:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = std::pow(a[r], b[r]);
+    break;
+  case OperatorKind::Less:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = a[r] < b[r] ? 1.0 : 0.0;
+    break;
+  case OperatorKind::LessEqual:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = a[r] <= b[r] ? 1.0 : 0.0;
+    break;
+  case OperatorKind::Greater:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = a[r] > b[r] ? 1.0 : 0.0;
+    break;
+  case OperatorKind::GreaterEqual:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = a[r] >= b[r] ? 1.0 : 0.0;
+    break;
+  case OperatorKind::Equal:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = a[r] == b[r] ? 1.0 : 0.0;
+    break;
+  case OperatorKind::NotEqual:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = a[r] != b[r] ? 1.0 : 0.0;
+    break;
+  case OperatorKind::And:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = (a[r] != 0.0) & (b[r] != 0.0) ? 1.0 : 0.0;
+    break;
+  case OperatorKind::Or:
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = (a[r] != 0.0) | (b[r] != 0.0) ? 1.0 : 0.0;
+    break;
+  case OperatorKind::Conditional:
+  case OperatorKind::None:
+    throw std::runtime_error("Unknown operator");
+  }
+}
+
+// Evaluates rows [0, rows) of one block of a group. 'columns' holds the
+// literal columns, 'rows' apart. Returns the result column.
+class BlockEvaluator {
+public:
+  BlockEvaluator(const std::vector<Token> &shape, ErrorTable &errors)
+      : shape(shape), table(errors), divisionByZero(errors.code("Division by zero")) {}
+
+  Column run(const double *columns, size_t rows) {
+    std::vector<Column> &st = stack;
+    st.clear();
+    size_t literal = 0;
+    for (const Token &tok : shape) {
+      if (tok.type == Token::Number) {
+        st.push_back({columns + literal++ * rows, nullptr});
+        if (st.size() > values.size()) {
+          values.emplace_back(blockRows);
+          codes.emplace_back();
+        }
+        continue;
+      }
+      size_t arity = tok.type == Token::Call ? tok.arity : tok.type == Token::Conditional ? 3 : 2;
+      size_t p = st.size() - arity;
+      const Column *args = st.data() + p;
+      double *out = values[p].data();
+      // Errors first: the operator may overwrite the values they depend on.
+      const std::uint32_t *errors = nullptr;
+      if (tok.type == Token::Conditional) {
+        errors = conditionalErrors(args, rows, p);
+        const double *c = args[0].values, *t = args[1].values, *e = args[2].values;
+        for (size_t r = 0; r < rows; ++r)
+          out[r] = c[r] != 0.0 ? t[r] : e[r];
+      } else if (tok.type == Token::Call) {
+        errors = call(*tok.function, args, static_cast<std::uint32_t>(arity), out, rows, p);
+      } else {
+        errors = binaryErrors(tok.kind, args[0], args[1], rows, p);
+        applyColumns(tok.kind, args[0].values, args[1].values, out, rows);
+      }
+      st.resize(p + 1);
+      st[p] = {out, errors};
+    }
+    return st[0];
+  }
+
+private:
+  std::uint32_t *errorColumn(size_t p) {
+    codes[p].resize(blockRows);
+    return codes[p].data();
+  }
+
+  // The first error in evaluation order; the right operand of '&&' and '||'
+  // counts only where the left one does not decide the result.
+  const std::uint32_t *binaryErrors(OperatorKind kind, Column a, Column b, size_t rows, size_t p) {
+    bool zero = false;
+    if (kind == OperatorKind::Divide) {
+      for (size_t r = 0; r < rows; ++r)
+        zero |= b.values[r] == 0.0;
+    }
+    if (!a.errors && !b.errors && !zero)
+      return nullptr;
+    std::uint32_t *e = errorColumn(p);
+    for (size_t r = 0; r < rows; ++r) {
+      std::uint32_t code = a.errors ? a.errors[r] : 0;
+      bool skipped = (kind == OperatorKind::And && a.values[r] == 0.0) ||
+                     (kind == OperatorKind::Or && a.values[r] != 0.0);
+      if (!code && !skipped && b.errors)
+        code = b.errors[r];
+      if (!code && zero && b.values[r] == 0.0)
+        code = divisionByZero;
+      e[r] = code;
+    }
+    return e;
+  }
+
+  const std::uint32_t *conditionalErrors(const Column *args, size_t rows, size_t p) {
+    if (!args[0].errors && !args[1].errors && !args[2].errors)
+      return nullptr;
+    std::uint32_t *e = errorColumn(p);
+    for (size_t r = 0; r < rows; ++r) {
+      std::uint32_t code = args[0].errors ? args[0].errors[r] : 0;
+      if (!code) {
+        const Column &branch = args[0].values[r] != 0.0 ? args[1] : args[2];
+        code = branch.errors ? branch.errors[r] : 0;
+      }
+      e[r] = code;
+    }
+    return e;
+  }
+
+  // Uses the function's column kernel. If that reports a domain error, the
+  // rows are redone one at a time to find which ones failed; kernels check
+  // their input before writing, so the arguments are still intact.
+  const std::uint32_t *call(const MathFunction &function, const Column *args, std::uint32_t count,
+                            double *out, size_t rows, size_t p) {
+    bool argumentErrors = false;
+    pointers.clear();
+    for (std::uint32_t k = 0; k < count; ++k) {
+      pointers.push_back(args[k].values);
+      argumentErrors |= args[k].errors != nullptr;
+    }
+    std::uint32_t *e = nullptr;
+    if (argumentErrors) {
+      e = errorColumn(p);
+      for (size_t r = 0; r < rows; ++r) {
+        std::uint32_t code = 0;
+        for (std::uint32_t k = 0; k < count && !code; ++k)
+          code = args[k].errors ? args[k].errors[r] : 0;
+        e[r] = code;
+      }
+    }
+    try {
+      function.batch(pointers.data(), count, out, rows);
+      return e;
+    } catch (const std::runtime_error &) {
+    }
+    if (!e) {
+      e = errorColumn(p);
+      std::fill(e, e + rows, 0u);
+    }
+    std::vector<double> row(count);
+    for (size_t r = 0; r < rows; ++r) {
+      if (e[r])
+        continue;
+      for (std::uint32_t k = 0; k < count; ++k)
+        row[k] = pointers[k][r];
+      try {
+        out[r] = function.call(row.data(), count);
+      } catch (const std::runtime_error &ex) {
+        e[r] = table.code(ex.what());
+      }
+    }
+    return e;
+  }
+
+  const std::vector<Token> &shape;
+  ErrorTable &table;
+  std::uint32_t divisionByZero;
+  std::vector<Column> stack;
+  std::vector<std::vector<double>> values;       // Result column per stack position.
+  std::vector<std::vector<std::uint32_t>> codes; // Error column per stack position.
+  std::vector<const double *> pointers;
+};
+
+// Key of the structure of postfix tokens: literals are replaced by '#'.
+void appendShape(std::string &key, const std::vector<Token> &postfix) {
+  key.clear();
+  for (const Token &tok : postfix) {
+    switch (tok.type) {
+    case Token::Number:
+      key += '#';
+      break;
+    case Token::Operator:
+      key += OperatorsHandling::getOperatorSymbol(tok.kind);
+      break;
+    case Token::Call:
+      if (tok.function) {
+        key += tok.function->name;
+        key += '@';
+        key += std::to_string(tok.arity);
+        break;
+      }
+      [[fallthrough]];
+    default:
+      key += tok.toString();
+    }
+    key += ' ';
+  }
+}
+} // namespace
+
+BatchEvaluator::Result BatchEvaluator::evaluate(const std::string &notation,
+                                                const std::vector<std::string> &exprs) const {
+  Result result;
+  result.values.assign(exprs.size(), std::numeric_limits<double>::quiet_NaN());
+
+  // Group the expressions by shape.
+  std::vector<Group> groups;
+  std::unordered_map<std::string, size_t> index;
+  std::string key;
+  for (size_t i = 0; i < exprs.size(); ++i) {
+    std::vector<Token> postfix;
+    try {
+      postfix = parsePostfix(notation, exprs[i]);
+    } catch (const std::runtime_error &e) {
+      result.errors.emplace_back(i, e.what());
+      continue;
+    }
+    appendShape(key, postfix);
+    auto found = index.find(key);
+    if (found == index.end()) {
+      found = index.emplace(key, groups.size()).first;
+      groups.emplace_back();
+      Group &group = groups.back();
+      group.shape = postfix; // Views into exprs[i], which outlives the call.
+      group.width = static_cast<size_t>(
+          std::count_if(postfix.begin(), postfix.end(), [](const Token &tok) { return tok.type == Token::Number; }));
+    }
+    Group &group = groups[found->second];
+    group.members.push_back(i);
+    for (const Token &tok : postfix) {
+      if (tok.type == Token::Number)
+        group.literals.push_back(tok.value);
+    }
+  }
+  result.shapes = groups.size();
+
+  ErrorTable table;
+  std::vector<double> columns;
+  for (const Group &group : groups) {
+    try {
+      // Checks the structure once for the whole group.
+      ExpressionProgram::compile(group.shape, notation);
+    } catch (const std::runtime_error &e) {
+      for (size_t member : group.members)
+        result.errors.emplace_back(member, e.what());
+      continue;
+    }
+    BlockEvaluator block(group.shape, table);
+    for (size_t begin = 0; begin < group.members.size(); begin += blockRows) {
+      size_t rows = std::min(blockRows, group.members.size() - begin);
+      // Transpose this block's literals into one column per literal.
+      columns.resize(group.width * rows);
+      const double *source = group.literals.data() + begin * group.width;
+      for (size_t r = 0; r < rows; ++r) {
+        for (size_t k = 0; k < group.width; ++k)
+          columns[k * rows + r] = source[r * group.width + k];
+      }
+      Column out = block.run(columns.data(), rows);
+      for (size_t r = 0; r < rows; ++r) {
+        size_t member = group.members[begin + r];
+        if (out.errors && out.errors[r]) {
+          result.errors.emplace_back(member, table.message(out.errors[r]));
+        } else {
+          result.values[member] = out.values[r];
+        }
+      }
+    }
+  }
+  std::sort(result.errors.begin(), result.errors.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+  return result;
+}
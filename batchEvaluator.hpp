@@ -0,0 +1,27 @@
+#pragma once
+
+#include "mathExpressionsHandling.hpp"
+#include <string>
+#include <utility>
+#include <vector>
+
+// Evaluates many expressions at once. Expressions with the same structure,
+// i.e. the same postfix sequence of operators, calls and literal positions,
+// such as "1*2+3/4" and "5*6+7/8", form one group. Each group is evaluated
+// as a single program over columns of its literals, one operator at a time
+// across all members, in loops the compiler can vectorize.
+//
+// Results match ExpressionEvaluator, including short-circuiting: an error in
+// an operand that '&&', '||' or 'if' would skip does not fail the
+// expression.
+class BatchEvaluator : public ExpressionParser {
+public:
+  struct Result {
+    std::vector<double> values; // In input order; NaN where evaluation failed.
+    std::vector<std::pair<size_t, std::string>> errors; // (input index, message), in input order.
+    size_t shapes = 0; // Number of distinct structures found.
+  };
+
+  // 'notation' is infix, prefix or postfix. Cell references are rejected.
+  Result evaluate(const std::string &notation, const std::vector<std::string> &exprs) const;
+};
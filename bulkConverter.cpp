@@ -0,0 +1,288 @@
+// Bulk converter for files with one expression per line.
+//
+// The input file is memory-mapped and split at line boundaries into chunks
+// that worker threads convert (or evaluate) independently. Each chunk's
+// output is collected in its own buffer and the buffers are written in the
+// original order with vectored writes, so the output has exactly one line per
+// input line in the same order. Lines that fail produce "error <message>".
+// With --to all, each line is parsed once and written as
+// "<prefix>\t<postfix>\t<canonical infix>".
+// Throughput is reported on stderr when done.
+//
+// Usage:
+//   bulkConverter --from infix|prefix|postfix --to infix|prefix|postfix|eval|all
+//                 [--threads N] [--chunk-size BYTES] INPUT [OUTPUT]
+// OUTPUT defaults to stdout.
+#include "mappedFile.hpp"
+#include "mathExpressionsHandling.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct ConverterOptions {
+  std::string from;
+  std::string to;
+  std::string inputPath;
+  std::string outputPath;
+  unsigned threads = 0;
+  size_t chunkSize = size_t(8) << 20;
+};
+
+struct Chunk {
+  const char *begin;
+  const char *end;
+  std::string output;
+  size_t lines = 0;
+  size_t errors = 0;
+  bool done = false;
+};
+
+std::vector<Chunk> splitAtLines(const MappedFile &file, size_t chunkSize) {
+  std::vector<Chunk> chunks;
+  const char *p = file.begin();
+  while (p < file.end()) {
+    const char *end = p + std::min(chunkSize, static_cast<size_t>(file.end() - p));
+    if (end < file.end()) {
+      const char *nl = static_cast<const char *>(
+          std::memchr(end, '\n', static_cast<size_t>(file.end() - end)));
+      end = nl ? nl + 1 : file.end();
+    }
+    chunks.push_back(Chunk{p, end, std::string(), 0, 0, false});
+    p = end;
+  }
+  return chunks;
+}
+
+void convertChunk(const ExpressionRequestProcessor &processor, const ExpressionConverter &converter,
+                  const ConverterOptions &options, Chunk &chunk) {
+  constexpr unsigned allForms =
+      ExpressionConverter::PrefixForm | ExpressionConverter::PostfixForm | ExpressionConverter::InfixForm;
+  std::string line;
+  ExpressionConverter::Forms forms;
+  chunk.output.reserve(static_cast<size_t>(chunk.end - chunk.begin) + 64);
+  for (const char *p = chunk.begin; p < chunk.end;) {
+    const char *nl = static_cast<const char *>(
+        std::memchr(p, '\n', static_cast<size_t>(chunk.end - p)));
+    const char *lineEnd = nl ? nl : chunk.end;
+    const char *contentEnd = lineEnd;
+    if (contentEnd > p && contentEnd[-1] == '\r')
+      --contentEnd;
+    line.assign(p, contentEnd); // Reuses the capacity of previous lines.
+    if (!line.empty()) {
+      try {
+        if (options.to == "all") {
+          converter.convertAll(options.from, line, allForms, forms);
+          chunk.output += forms.prefix;
+          chunk.output += '\t';
+          chunk.output += forms.postfix;
+          chunk.output += '\t';
+          chunk.output += forms.infix;
+        } else {
+          processor.process(options.from, options.to, line, chunk.output);
+        }
+      } catch (const std::exception &e) {
+        chunk.output += "error ";
+        chunk.output += e.what();
+        ++chunk.errors;
+      }
+    }
+    chunk.output += '\n';
+    ++chunk.lines;
+    p = nl ? nl + 1 : chunk.end;
+  }
+}
+
+// Writes the finished chunks in order, gathering as many consecutive chunks
+// as are ready into one writev call.
+class OrderedWriter {
+public:
+  explicit OrderedWriter(int fd) : fd(fd) {}
+
+  void write(std::vector<Chunk *> &ready) {
+    std::vector<iovec> iov;
+    for (Chunk *chunk : ready)
+      if (!chunk->output.empty())
+        iov.push_back(iovec{const_cast<char *>(chunk->output.data()), chunk->output.size()});
+    size_t index = 0;
+    while (index < iov.size()) {
+      int count = static_cast<int>(std::min<size_t>(iov.size() - index, IOV_MAX));
+      ssize_t n = ::writev(fd, iov.data() + index, count);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        throw std::runtime_error(std::string("write: ") + std::strerror(errno));
+      size_t written = static_cast<size_t>(n);
+      while (index < iov.size() && written >= iov[index].iov_len) {
+        written -= iov[index].iov_len;
+        ++index;
+      }
+      if (index < iov.size()) {
+        iov[index].iov_base = static_cast<char *>(iov[index].iov_base) + written;
+        iov[index].iov_len -= written;
+      }
+    }
+  }
+
+private:
+  int fd;
+};
+
+ConverterOptions parseOptions(int argc, char **argv) {
+  ConverterOptions options;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc)
+        throw std::runtime_error("Missing value for " + arg);
+      return argv[++i];
+    };
+    if (arg == "--from") {
+      options.from = value();
+    } else if (arg == "--to") {
+      options.to = value();
+    } else if (arg == "--threads") {
+      options.threads = static_cast<unsigned>(std::stoul(value()));
+    } else if (arg == "--chunk-size") {
+      options.chunkSize = std::max<size_t>(1, std::stoul(value()));
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      throw std::runtime_error("Unknown option " + arg);
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if (options.from.empty() || options.to.empty() || positional.empty() || positional.size() > 2)
+    throw std::runtime_error("Usage: bulkConverter --from NOTATION --to NOTATION|eval|all "
+                             "[--threads N] [--chunk-size BYTES] INPUT [OUTPUT]");
+  options.inputPath = positional[0];
+  if (positional.size() == 2)
+    options.outputPath = positional[1];
+  if (options.threads == 0)
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+  return options;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  try {
+    ConverterOptions options = parseOptions(argc, argv);
+    // Validate the notation pair once up front instead of failing every line.
+    ExpressionRequestProcessor processor;
+    ExpressionConverter converter;
+    if (options.to == "all")
+      converter.convertAll(options.from, "1");
+    else
+      processor.process(options.from, options.to, "1");
+
+    auto start = std::chrono::steady_clock::now();
+    MappedFile input(options.inputPath);
+    std::vector<Chunk> chunks = splitAtLines(input, options.chunkSize);
+
+    int outFd = STDOUT_FILENO;
+    if (!options.outputPath.empty() && options.outputPath != "-") {
+      outFd = ::open(options.outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (outFd < 0)
+        throw std::runtime_error("Cannot open " + options.outputPath + ": " + std::strerror(errno));
+    }
+
+    // Workers claim chunks in order but may run at most 'window' chunks ahead
+    // of the writer, which bounds the memory held by unwritten output.
+    const size_t window = static_cast<size_t>(options.threads) * 2;
+    std::atomic<size_t> nextChunk{0};
+    size_t written = 0;
+    bool stopped = false; // The writer failed; workers quit.
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    auto worker = [&] {
+      for (;;) {
+        size_t index = nextChunk.fetch_add(1);
+        if (index >= chunks.size())
+          return;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [&] { return stopped || index < written + window; });
+          if (stopped)
+            return;
+        }
+        convertChunk(processor, converter, options, chunks[index]);
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          chunks[index].done = true;
+        }
+        cv.notify_all();
+      }
+    };
+    OrderedWriter writer(outFd);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < options.threads; ++i)
+      threads.emplace_back(worker);
+
+    size_t lines = 0;
+    size_t errors = 0;
+    // Stop and join the workers before the error leaves this scope;
+    // destroying joinable threads would terminate the process.
+    try {
+      while (written < chunks.size()) {
+        std::vector<Chunk *> ready;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [&] { return chunks[written].done; });
+          for (size_t i = written; i < chunks.size() && chunks[i].done; ++i)
+            ready.push_back(&chunks[i]);
+        }
+        writer.write(ready);
+        for (Chunk *chunk : ready) {
+          lines += chunk->lines;
+          errors += chunk->errors;
+          std::string().swap(chunk->output); // Release the buffer right away.
+        }
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          written += ready.size();
+        }
+        cv.notify_all();
+      }
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+      }
+      cv.notify_all();
+      for (auto &t : threads)
+        t.join();
+      throw;
+    }
+    for (auto &t : threads)
+      t.join();
+    if (outFd != STDOUT_FILENO)
+      ::close(outFd);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << std::fixed << std::setprecision(1) << "Converted " << lines << " lines ("
+              << errors << " errors), " << input.size() << " bytes in " << seconds << " s: "
+              << static_cast<double>(lines) / seconds << " lines/s, "
+              << static_cast<double>(input.size()) / seconds / (1 << 20) << " MiB/s\n";
+    return errors == 0 ? 0 : 2;
+  } catch (const std::exception &e) {
+    std::cerr << "bulkConverter: " << e.what() << '\n';
+    return 1;
+  }
+}
@@ -0,0 +1,298 @@
+#include "expressionCanonicalizer.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+constexpr std::uint64_t lowSeed = 0x9e3779b97f4a7c15ULL;
+constexpr std::uint64_t highSeed = 0xc2b2ae3d27d4eb4fULL;
+
+enum Tag : std::uint64_t { NumberTag = 1, CellTag, OperatorTag };
+
+// MurmurHash3 64-bit finalizer.
+std::uint64_t mix(std::uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// FNV-1a; unlike std::hash it is the same on every platform.
+std::uint64_t hashText(const std::string &text) {
+  std::uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : text) {
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+StructuralHash leafHash(std::uint64_t tag, std::uint64_t payload) {
+  StructuralHash h;
+  h.high = mix(payload ^ mix(tag ^ highSeed));
+  h.low = mix(payload ^ mix(tag ^ lowSeed));
+  return h;
+}
+
+// Shortest round-trip digits in fixed notation; the tokenizer does not read
+// exponents.
+std::string canonicalLiteral(double value) {
+  char buf[400]; // Enough for any finite double.
+  auto res = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::fixed);
+  return std::string(buf, res.ptr);
+}
+} // namespace
+
+std::string StructuralHash::toHex() const {
+  static const char digits[] = "0123456789abcdef";
+  std::string out(32, '0');
+  for (int i = 0; i < 16; ++i) {
+    out[15 - i] = digits[(high >> (4 * i)) & 0xf];
+    out[31 - i] = digits[(low >> (4 * i)) & 0xf];
+  }
+  return out;
+}
+
+struct ExpressionCanonicalizer::Tree {
+  struct Node {
+    enum Type : std::uint8_t { Number, Cell, Operator, Call } type;
+    std::string token; // Canonical literal, cell, operator, function or "if".
+    double value = 0.0;
+    bool commutative = false;
+    bool associative = false;
+    bool absorbed = false;   // Flattened into a parent of the same operator.
+    std::uint32_t rawFirst = 0, rawArity = 0; // Operands as parsed.
+    std::uint32_t first = 0, arity = 0;       // Operands after flattening.
+    StructuralHash hash;
+  };
+  std::vector<Node> nodes; // Postfix order: operands before operators.
+  std::vector<std::uint32_t> rawOperands;
+  std::vector<std::uint32_t> operands;
+  std::uint32_t root = 0;
+};
+
+void ExpressionCanonicalizer::build(Tree &tree, const std::string &notation,
+                                    const std::string &expr) const {
+  std::vector<Token> tokens = parsePostfix(notation, expr);
+
+  // Build the parse tree, marking operands that continue their parent's
+  // associative chain.
+  auto &nodes = tree.nodes;
+  nodes.reserve(tokens.size());
+  tree.rawOperands.reserve(tokens.size());
+  std::vector<std::uint32_t> st;
+  for (const Token &tok : tokens) {
+    int arity = getArity(tok);
+    if (arity < 0) {
+      throw std::runtime_error("Invalid token in " + notation + " expression: " + tok.toString());
+    }
+    if (st.size() < static_cast<size_t>(arity)) {
+      throw std::runtime_error("Invalid " + notation + " expression: insufficient operands for operator " +
+                               tok.toString());
+    }
+    Tree::Node node;
+    if (tok.type == Token::Number) {
+      node.type = Tree::Node::Number;
+      node.value = tok.value;
+      node.token = canonicalLiteral(node.value);
+    } else if (tok.type == Token::Cell) {
+      node.type = Tree::Node::Cell;
+      node.token = std::string(tok.text);
+    } else if (tok.type == Token::Operator) {
+      OperatorKind kind = tok.kind;
+      node.type = Tree::Node::Operator;
+      node.token = OperatorsHandling::getOperatorSymbol(kind);
+      node.commutative = kind == OperatorKind::Add || kind == OperatorKind::Multiply ||
+                         kind == OperatorKind::Equal || kind == OperatorKind::NotEqual;
+      node.associative = kind == OperatorKind::Add || kind == OperatorKind::Multiply ||
+                         kind == OperatorKind::And || kind == OperatorKind::Or;
+    } else {
+      node.type = Tree::Node::Call;
+      node.token = tok.type == Token::Conditional ? "if" : tok.function->name;
+      node.commutative = node.associative = node.token == "min" || node.token == "max";
+    }
+    node.rawFirst = static_cast<std::uint32_t>(tree.rawOperands.size());
+    node.rawArity = static_cast<std::uint32_t>(arity);
+    for (size_t k = st.size() - arity; k < st.size(); ++k) {
+      Tree::Node &operand = nodes[st[k]];
+      operand.absorbed = node.associative && operand.type == node.type && operand.token == node.token;
+      tree.rawOperands.push_back(st[k]);
+    }
+    st.resize(st.size() - arity);
+    st.push_back(static_cast<std::uint32_t>(nodes.size()));
+    nodes.push_back(std::move(node));
+  }
+  if (st.size() != 1) {
+    throw std::runtime_error("Invalid " + notation + " expression: The final stack should contain exactly one item.");
+  }
+  tree.root = st.back();
+
+  // Flatten chains and hash bottom-up. Each absorbed node is expanded only
+  // by the one chain it belongs to, so this pass is linear.
+  tree.operands.reserve(tree.rawOperands.size());
+  std::vector<std::uint32_t> pending;
+  for (std::uint32_t id = 0; id < nodes.size(); ++id) {
+    Tree::Node &node = nodes[id];
+    if (node.absorbed) {
+      continue;
+    }
+    node.first = static_cast<std::uint32_t>(tree.operands.size());
+    for (std::uint32_t k = node.rawArity; k-- > 0;) {
+      pending.push_back(tree.rawOperands[node.rawFirst + k]);
+    }
+    while (!pending.empty()) {
+      std::uint32_t child = pending.back();
+      pending.pop_back();
+      const Tree::Node &c = nodes[child];
+      if (c.absorbed) {
+        for (std::uint32_t k = c.rawArity; k-- > 0;) {
+          pending.push_back(tree.rawOperands[c.rawFirst + k]);
+        }
+      } else {
+        tree.operands.push_back(child);
+      }
+    }
+    node.arity = static_cast<std::uint32_t>(tree.operands.size()) - node.first;
+
+    if (node.type == Tree::Node::Number) {
+      std::uint64_t bits;
+      std::memcpy(&bits, &node.value, sizeof(bits));
+      node.hash = leafHash(NumberTag, bits);
+      continue;
+    }
+    if (node.type == Tree::Node::Cell) {
+      node.hash = leafHash(CellTag, hashText(node.token));
+      continue;
+    }
+    StructuralHash h = leafHash(OperatorTag, hashText(node.token) ^ mix(node.arity));
+    if (node.commutative) {
+      // A sum of mixed operand hashes does not depend on operand order.
+      std::uint64_t sumHigh = 0, sumLow = 0;
+      for (std::uint32_t k = 0; k < node.arity; ++k) {
+        const StructuralHash &o = nodes[tree.operands[node.first + k]].hash;
+        sumHigh += mix(o.high ^ highSeed);
+        sumLow += mix(o.low ^ lowSeed);
+      }
+      h.high = mix(h.high ^ sumHigh);
+      h.low = mix(h.low ^ sumLow);
+    } else {
+      for (std::uint32_t k = 0; k < node.arity; ++k) {
+        const StructuralHash &o = nodes[tree.operands[node.first + k]].hash;
+        h.high = mix(h.high ^ o.high) + highSeed;
+        h.low = mix(h.low ^ o.low) + lowSeed;
+      }
+    }
+    node.hash = h;
+  }
+}
+
+StructuralHash ExpressionCanonicalizer::hash(const std::string &notation,
+                                             const std::string &expr) const {
+  Tree tree;
+  build(tree, notation, expr);
+  return tree.nodes[tree.root].hash;
+}
+
+ExpressionCanonicalizer::Result
+ExpressionCanonicalizer::canonicalize(const std::string &notation,
+                                      const std::string &expr) const {
+  Tree tree;
+  build(tree, notation, expr);
+  const auto &nodes = tree.nodes;
+
+  // Numbers first by value, then cells by name, then everything else by hash.
+  auto before = [&nodes](std::uint32_t a, std::uint32_t b) {
+    const Tree::Node &x = nodes[a];
+    const Tree::Node &y = nodes[b];
+    int rankX = std::min<int>(x.type, Tree::Node::Operator);
+    int rankY = std::min<int>(y.type, Tree::Node::Operator);
+    if (rankX != rankY)
+      return rankX < rankY;
+    if (x.type == Tree::Node::Number)
+      return x.value < y.value;
+    if (x.type == Tree::Node::Cell)
+      return x.token < y.token;
+    return std::make_pair(x.hash.high, x.hash.low) < std::make_pair(y.hash.high, y.hash.low);
+  };
+  for (const Tree::Node &node : nodes) {
+    if (node.commutative && !node.absorbed) {
+      auto begin = tree.operands.begin() + node.first;
+      std::sort(begin, begin + node.arity, before);
+    }
+  }
+
+  // Chains are written nested to the left, "( ( a + b ) + c )"; calls and
+  // 'if' as "name ( a , b , ... )", matching ExpressionConverter. The length
+  // of each subexpression is known bottom-up, so the output limit is checked
+  // before anything is written.
+  std::vector<size_t> length(nodes.size());
+  for (std::uint32_t id = 0; id < nodes.size(); ++id) {
+    const Tree::Node &n = nodes[id];
+    if (n.absorbed)
+      continue;
+    size_t len = n.arity == 0 ? n.token.size() : 0;
+    for (std::uint32_t k = 0; k < n.arity; ++k)
+      len += length[tree.operands[n.first + k]];
+    // Besides the operands, an operator writes n-1 each of "(", itself and
+    // ")"; a call its name, "(", n-1 commas and ")". One space separates
+    // every two pieces.
+    if (n.arity > 0 && n.type == Tree::Node::Operator)
+      len += (n.arity - 1) * (n.token.size() + 2) + (4 * n.arity - 4);
+    else if (n.arity > 0)
+      len += n.token.size() + 2 + (n.arity - 1) + (2 * n.arity + 1);
+    length[id] = len;
+  }
+  checkOutputBytes(length[tree.root]);
+
+  Result result;
+  result.hash = nodes[tree.root].hash;
+  std::string &out = result.infix;
+  out.reserve(length[tree.root]);
+  static const std::string open = "(", close = ")", comma = ",";
+  auto append = [&out](const std::string &piece) {
+    if (!out.empty())
+      out += ' ';
+    out += piece;
+  };
+  // Entries with a null piece are nodes to expand.
+  std::vector<std::pair<std::uint32_t, const std::string *>> st{{tree.root, nullptr}};
+  while (!st.empty()) {
+    auto [id, text] = st.back();
+    st.pop_back();
+    if (text) {
+      append(*text);
+      continue;
+    }
+    const Tree::Node &n = nodes[id];
+    const std::uint32_t *args = tree.operands.data() + n.first;
+    if (n.arity == 0) {
+      append(n.token);
+    } else if (n.type == Tree::Node::Operator) {
+      for (std::uint32_t k = 1; k < n.arity; ++k) {
+        append(open);
+      }
+      for (std::uint32_t k = n.arity; k-- > 1;) {
+        st.push_back({id, &close});
+        st.push_back({args[k], nullptr});
+        st.push_back({id, &n.token});
+      }
+      st.push_back({args[0], nullptr});
+    } else {
+      append(n.token);
+      append(open);
+      st.push_back({id, &close});
+      for (std::uint32_t k = n.arity; k-- > 0;) {
+        st.push_back({args[k], nullptr});
+        if (k > 0)
+          st.push_back({id, &comma});
+      }
+    }
+  }
+  return result;
+}
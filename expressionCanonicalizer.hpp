@@ -0,0 +1,52 @@
+#pragma once
+
+#include "mathExpressionsHandling.hpp"
+#include <cstdint>
+#include <string>
+
+// 128-bit structural hash. The value depends only on the canonical form of
+// the expression, not on the process, platform or input notation; 'low'
+// alone may be used as a 64-bit hash.
+struct StructuralHash {
+  std::uint64_t high = 0;
+  std::uint64_t low = 0;
+
+  bool operator==(const StructuralHash &other) const {
+    return high == other.high && low == other.low;
+  }
+  bool operator!=(const StructuralHash &other) const { return !(*this == other); }
+  // 32 lowercase hex digits, high half first.
+  std::string toHex() const;
+};
+
+// Puts expressions written in any notation into one canonical form, so that
+// "2+3*x", "( 2 + ( 3 * x ) )" and "+ 2 * 3 x" compare equal:
+//  - number literals are normalized ("2.0", "2." and "2" are the same);
+//  - '**' and '^' are both written '**';
+//  - chains of '+', '*', '&&', '||', min and max are flattened, so
+//    "(a+b)+c" and "a+(b+c)" are the same;
+//  - operands of '+', '*', '==', '!=', min and max are sorted: numbers by
+//    value, then cells by name, then compound operands by hash.
+// '&&' and '||' keep their operand order, since it decides which operands
+// short-circuit evaluation skips.
+//
+// The canonical form is written as canonical infix, which all parsers
+// accept again. Hashing is linear in the number of tokens. The inherited
+// 'limits' apply to parsing the input and to the canonical text written.
+class ExpressionCanonicalizer : public ExpressionParser {
+public:
+  struct Result {
+    std::string infix;
+    StructuralHash hash;
+  };
+
+  // 'notation' is infix, prefix or postfix. Throws std::runtime_error on
+  // malformed input.
+  Result canonicalize(const std::string &notation, const std::string &expr) const;
+  // Same hash as canonicalize(), without writing the canonical text.
+  StructuralHash hash(const std::string &notation, const std::string &expr) const;
+
+private:
+  struct Tree;
+  void build(Tree &tree, const std::string &notation, const std::string &expr) const;
+};
@@ -0,0 +1,340 @@
+#include "expressionDag.hpp"
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+ExpressionDag::ExpressionDag() : index(0, NodeHash{this}, NodeEqual{this}) {}
+
+size_t ExpressionDag::NodeHash::operator()(NodeId id) const {
+  const Node &n = dag->nodes[id];
+  size_t h = std::hash<std::string>()(n.token);
+  for (std::uint32_t i = 0; i < n.arity; ++i) {
+    h ^= static_cast<size_t>(dag->operand(id, i)) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  }
+  return h;
+}
+
+bool ExpressionDag::NodeEqual::operator()(NodeId a, NodeId b) const {
+  const Node &x = dag->nodes[a];
+  const Node &y = dag->nodes[b];
+  if (x.arity != y.arity || x.token != y.token) {
+    return false;
+  }
+  for (std::uint32_t i = 0; i < x.arity; ++i) {
+    if (dag->operand(a, i) != dag->operand(b, i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Appends the candidate node, then drops it again if an identical node was
+// already interned. This avoids building a separate lookup key per node.
+ExpressionDag::NodeId ExpressionDag::intern(const std::string &token, OperatorKind kind,
+                                            double value, const NodeId *args,
+                                            std::uint32_t arity,
+                                            const MathFunction *function) {
+  if (nodes.size() >= std::numeric_limits<NodeId>::max()) {
+    throw std::runtime_error("Expression DAG is full.");
+  }
+  for (std::uint32_t i = 0; i < arity; ++i) {
+    if (args[i] >= nodes.size()) {
+      throw std::runtime_error("Invalid operand for operator " + token);
+    }
+  }
+  NodeId candidate = static_cast<NodeId>(nodes.size());
+  nodes.push_back(Node{token, kind, value, static_cast<std::uint32_t>(operands.size()), arity, function});
+  operands.insert(operands.end(), args, args + arity);
+  auto result = index.insert(candidate);
+  if (!result.second) {
+    nodes.pop_back();
+    operands.resize(operands.size() - arity);
+  }
+  return *result.first;
+}
+
+ExpressionDag::NodeId ExpressionDag::addNumber(const std::string &literal) {
+  if (!isNum(literal)) {
+    throw std::runtime_error("Invalid number: " + literal);
+  }
+  return intern(literal, OperatorKind::None, parseNumber(literal), nullptr, 0);
+}
+
+ExpressionDag::NodeId ExpressionDag::addOperator(const std::string &op,
+                                                 NodeId left, NodeId right) {
+  if (!opHandling.isOperator(op)) {
+    throw std::runtime_error("Unknown operator: " + op);
+  }
+  NodeId args[] = {left, right};
+  return intern(op, opHandling.getOperatorKind(op), 0.0, args, 2);
+}
+
+ExpressionDag::NodeId ExpressionDag::addConditional(NodeId condition, NodeId then,
+                                                    NodeId otherwise) {
+  NodeId args[] = {condition, then, otherwise};
+  return intern("if", OperatorKind::Conditional, 0.0, args, 3);
+}
+
+ExpressionDag::NodeId ExpressionDag::addCall(const std::string &function, const NodeId *args,
+                                             std::uint32_t count) {
+  const MathFunction *target = findFunction(function);
+  if (!target) {
+    throw std::runtime_error("Unknown function: " + function);
+  }
+  if (count < target->minArgs || count > target->maxArgs) {
+    throw std::runtime_error("Wrong number of arguments for function " + function);
+  }
+  return intern(function + "@" + std::to_string(count), OperatorKind::None, 0.0, args, count, target);
+}
+
+ExpressionDag::NodeId ExpressionDag::addPostfixTokens(TokenSpan tokens,
+                                                     const std::string &notation) {
+  std::vector<NodeId> st;
+  std::string scratch;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    const Token &tok = tokens[i];
+    int arity = getArity(tok);
+    if (arity < 0 || tok.type == Token::Cell) {
+      throw std::runtime_error("Invalid token in " + notation + " expression: " + tok.toString());
+    }
+    if (st.size() < static_cast<size_t>(arity)) {
+      throw std::runtime_error("Invalid " + notation + " expression: insufficient operands for operator " +
+                               tok.toString());
+    }
+    NodeId id;
+    if (tok.type == Token::Number) {
+      id = intern(std::string(spelling(tokens, i, scratch)), OperatorKind::None, tok.value, nullptr, 0);
+    } else {
+      const NodeId *args = st.data() + st.size() - arity;
+      if (tok.type == Token::Operator) {
+        id = addOperator(std::string(spelling(tokens, i, scratch)), args[0], args[1]);
+      } else if (tok.type == Token::Conditional) {
+        id = addConditional(args[0], args[1], args[2]);
+      } else {
+        id = addCall(tok.function->name, args, static_cast<std::uint32_t>(arity));
+      }
+      st.resize(st.size() - arity);
+    }
+    st.push_back(id);
+  }
+  if (st.size() != 1) {
+    throw std::runtime_error("Invalid " + notation + " expression: The final stack should contain exactly one item.");
+  }
+  return st.back();
+}
+
+ExpressionDag::NodeId ExpressionDag::addInfix(const std::string &expr) {
+  return addPostfixTokens(parsePostfix("infix", expr), "infix");
+}
+
+ExpressionDag::NodeId ExpressionDag::addPostfix(const std::string &expr) {
+  return addPostfixTokens(parsePostfix("postfix", expr), "postfix");
+}
+
+ExpressionDag::NodeId ExpressionDag::addPrefix(const std::string &expr) {
+  return addPostfixTokens(parsePostfix("prefix", expr), "prefix");
+}
+
+void ExpressionDag::clear() {
+  index.clear();
+  nodes.clear();
+  operands.clear();
+}
+
+// Length of the expanded text of root, computed once per distinct node.
+size_t ExpressionDag::expandedLength(NodeId root, bool infix) const {
+  std::vector<size_t> length(root + 1);
+  for (NodeId id = 0; id <= root; ++id) {
+    const Node &n = nodes[id];
+    // Infix writes a call by its bare name, without the "@N".
+    size_t len = infix && n.function ? n.function->name.size() : n.token.size();
+    for (std::uint32_t i = 0; i < n.arity; ++i) {
+      len += length[operand(id, i)] + 1;
+    }
+    if (infix && n.arity == 2 && !n.function) {
+      len += 4; // "( " and " )"
+    } else if (infix && n.arity > 0) {
+      len += 4 + 2 * (n.arity - 1); // " (", " )" and the " ," separators
+    }
+    length[id] = std::min(len, std::string().max_size() / 2); // Saturate.
+  }
+  return length[root];
+}
+
+// The expansion may be exponentially larger than the DAG, so its length is
+// checked against the output limit before anything is written.
+size_t ExpressionDag::outputLength(NodeId root, bool infix) const {
+  size_t length = expandedLength(root, infix);
+  checkOutputBytes(length);
+  return length;
+}
+
+std::string ExpressionDag::toPrefix(NodeId root) const {
+  std::string out;
+  out.reserve(outputLength(root, false));
+  std::vector<NodeId> st{root};
+  while (!st.empty()) {
+    NodeId id = st.back();
+    st.pop_back();
+    const Node &n = nodes[id];
+    if (!out.empty())
+      out += ' ';
+    out += n.token;
+    for (std::uint32_t i = n.arity; i-- > 0;) {
+      st.push_back(operand(id, i));
+    }
+  }
+  return out;
+}
+
+std::string ExpressionDag::toPostfix(NodeId root) const {
+  std::string out;
+  out.reserve(outputLength(root, false));
+  // second == true once the operands of the node have been emitted.
+  std::vector<std::pair<NodeId, bool>> st{{root, false}};
+  while (!st.empty()) {
+    auto [id, operandsDone] = st.back();
+    st.pop_back();
+    const Node &n = nodes[id];
+    if (n.arity > 0 && !operandsDone) {
+      st.push_back({id, true});
+      for (std::uint32_t i = n.arity; i-- > 0;) {
+        st.push_back({operand(id, i), false});
+      }
+      continue;
+    }
+    if (!out.empty())
+      out += ' ';
+    out += n.token;
+  }
+  return out;
+}
+
+std::string ExpressionDag::toInfix(NodeId root) const {
+  // Binary operators become "( left op right )"; 'if' and calls become
+  // "name ( a , b , ... )", both exactly as ExpressionConverter::postfixToInfix
+  // writes them.
+  std::string out;
+  out.reserve(outputLength(root, true));
+  std::vector<std::pair<NodeId, const std::string *>> st;
+  static const std::string open = "(", close = ")", comma = ",";
+  auto append = [&out](const std::string &piece) {
+    if (!out.empty())
+      out += ' ';
+    out += piece;
+  };
+  // Entries with a null piece are nodes to expand.
+  st.push_back({root, nullptr});
+  while (!st.empty()) {
+    auto [id, text] = st.back();
+    st.pop_back();
+    if (text) {
+      append(*text);
+      continue;
+    }
+    const Node &n = nodes[id];
+    if (n.arity == 0) {
+      append(n.token);
+    } else if (n.arity == 2 && !n.function) {
+      append(open);
+      st.push_back({id, &close});
+      st.push_back({operand(id, 1), nullptr});
+      st.push_back({id, &n.token});
+      st.push_back({operand(id, 0), nullptr});
+    } else {
+      append(n.function ? n.function->name : n.token);
+      append(open);
+      st.push_back({id, &close});
+      for (std::uint32_t i = n.arity; i-- > 0;) {
+        st.push_back({operand(id, i), nullptr});
+        if (i > 0)
+          st.push_back({id, &comma});
+      }
+    }
+  }
+  return out;
+}
+
+double ExpressionDag::evaluate(NodeId root) const {
+  double result = 0.0;
+  runLimited([&] { result = evaluateNodes(root); });
+  return result;
+}
+
+// One work unit per visit of a node; a node is visited once per operand
+// it waits for, plus once to compute it.
+double ExpressionDag::evaluateNodes(NodeId root) const {
+  std::vector<double> value(root + 1);
+  std::vector<bool> done(root + 1, false);
+  std::vector<NodeId> st{root};
+  std::vector<double> args;
+  // Returns true if 'id' is evaluated; otherwise schedules it and returns
+  // false so the caller revisits its parent later.
+  auto need = [&](NodeId id) {
+    if (done[id])
+      return true;
+    st.push_back(id);
+    return false;
+  };
+  while (!st.empty()) {
+    chargeWork(1);
+    NodeId id = st.back();
+    if (done[id]) {
+      st.pop_back();
+      continue;
+    }
+    const Node &n = nodes[id];
+    if (n.arity == 0) {
+      value[id] = n.value;
+    } else if (n.kind == OperatorKind::Conditional) {
+      NodeId condition = operand(id, 0);
+      if (!need(condition))
+        continue;
+      NodeId branch = operand(id, value[condition] != 0.0 ? 1 : 2);
+      if (!need(branch))
+        continue;
+      value[id] = value[branch];
+    } else if (n.kind == OperatorKind::And || n.kind == OperatorKind::Or) {
+      NodeId left = operand(id, 0);
+      if (!need(left))
+        continue;
+      bool decided = (n.kind == OperatorKind::And) == (value[left] == 0.0);
+      if (decided) {
+        value[id] = n.kind == OperatorKind::And ? 0.0 : 1.0;
+      } else {
+        NodeId right = operand(id, 1);
+        if (!need(right))
+          continue;
+        value[id] = value[right] != 0.0 ? 1.0 : 0.0;
+      }
+    } else if (n.function) {
+      bool ready = true;
+      for (std::uint32_t i = n.arity; i-- > 0;) {
+        ready &= need(operand(id, i));
+      }
+      if (!ready)
+        continue;
+      args.clear();
+      for (std::uint32_t i = 0; i < n.arity; ++i) {
+        args.push_back(value[operand(id, i)]);
+      }
+      value[id] = n.function->call(args.data(), n.arity);
+    } else {
+      NodeId left = operand(id, 0), right = operand(id, 1);
+      bool ready = done[left] && done[right];
+      if (!ready) {
+        need(right);
+        need(left);
+        continue;
+      }
+      value[id] = applyOperator(n.kind, value[left], value[right]);
+    }
+    done[id] = true;
+    st.pop_back();
+  }
+  return value[root];
+}
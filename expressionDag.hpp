@@ -0,0 +1,82 @@
+#pragma once
+
+#include "mathExpressionsHandling.hpp"
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Hash-consed expression DAG. Structurally identical subtrees are interned
+// once, so an expression that repeats a subexpression thousands of times
+// stores and evaluates it once. Several expressions may share one DAG; each
+// add* call returns the root of the expression it added.
+//
+// Children are always interned before their parents, so a node's id is
+// greater than the ids of everything below it.
+//
+// The inherited 'limits' apply to the text parsed by addInfix, addPrefix
+// and addPostfix, to the expanded text the emitters would write, and to
+// the node visits of evaluate. Nodes added one at a time are not limited.
+class ExpressionDag : public ExpressionParser {
+public:
+  using NodeId = std::uint32_t;
+
+  struct Node {
+    std::string token;          // Number literal, operator symbol, "if" or call.
+    OperatorKind kind;          // OperatorKind::None for numbers and calls.
+    double value;               // Parsed literal; unused for operators.
+    std::uint32_t firstOperand; // Index of the first operand in the pool.
+    std::uint32_t arity;        // 0 for numbers.
+    const MathFunction *function; // Resolved target of a call, else null.
+  };
+
+  ExpressionDag();
+  // The intern table refers back to the DAG, so it cannot be copied.
+  ExpressionDag(const ExpressionDag &) = delete;
+  ExpressionDag &operator=(const ExpressionDag &) = delete;
+
+  NodeId addInfix(const std::string &expr);
+  NodeId addPrefix(const std::string &expr);
+  NodeId addPostfix(const std::string &expr);
+  NodeId addNumber(const std::string &literal);
+  NodeId addOperator(const std::string &op, NodeId left, NodeId right);
+  NodeId addConditional(NodeId condition, NodeId then, NodeId otherwise);
+  NodeId addCall(const std::string &function, const NodeId *args, std::uint32_t count);
+
+  // Emitters write the fully expanded expression in the same format as
+  // ExpressionConverter, straight into one pre-sized string.
+  std::string toInfix(NodeId root) const;
+  std::string toPrefix(NodeId root) const;
+  std::string toPostfix(NodeId root) const;
+
+  // Evaluates every distinct subtree below root at most once. '&&', '||'
+  // and 'if' only evaluate the operands they need.
+  double evaluate(NodeId root) const;
+
+  const Node &node(NodeId id) const { return nodes[id]; }
+  NodeId operand(NodeId id, size_t i) const { return operands[nodes[id].firstOperand + i]; }
+  size_t size() const { return nodes.size(); }
+  void clear();
+
+private:
+  struct NodeHash {
+    const ExpressionDag *dag;
+    size_t operator()(NodeId id) const;
+  };
+  struct NodeEqual {
+    const ExpressionDag *dag;
+    bool operator()(NodeId a, NodeId b) const;
+  };
+
+  NodeId intern(const std::string &token, OperatorKind kind, double value,
+                const NodeId *args, std::uint32_t arity,
+                const MathFunction *function = nullptr);
+  NodeId addPostfixTokens(TokenSpan tokens, const std::string &notation);
+  size_t expandedLength(NodeId root, bool infix) const;
+  size_t outputLength(NodeId root, bool infix) const;
+  double evaluateNodes(NodeId root) const;
+
+  std::vector<Node> nodes;
+  std::vector<NodeId> operands; // Operand lists of all nodes, back to back.
+  std::unordered_set<NodeId, NodeHash, NodeEqual> index;
+};
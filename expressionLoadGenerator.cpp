@@ -0,0 +1,301 @@
+// Load generator for expressionServer.
+//
+// Opens one or more connections to the server's Unix domain socket and keeps
+// up to --window requests in flight on each of them. Since the server answers
+// in request order, the n-th response on a connection belongs to the n-th
+// request, which gives per-request latency without any request ids. Reports
+// throughput and latency percentiles when done.
+//
+// Requests are read from --file (one request per line, cycled as needed) or
+// default to a built-in mix of conversions and evaluations.
+//
+// Usage:
+//   expressionLoadGenerator --socket PATH [--requests N] [--connections N]
+//                           [--window N] [--file PATH] [--length-prefixed]
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct LoadOptions {
+  std::string socketPath;
+  std::string requestFile;
+  size_t requests = 100000;
+  unsigned connections = 1;
+  size_t window = 128;
+  bool lengthPrefixed = false;
+};
+
+struct ConnectionResult {
+  std::vector<double> latenciesUs;
+  size_t errors = 0;
+};
+
+const std::vector<std::string> defaultRequests = {
+    "infix eval 1+2*3-4/2",
+    "infix postfix (20-(3*4))/(15-(2**3))",
+    "infix prefix 3.14 * (2.0 + 1.0)",
+    "postfix eval 9 5 - 3 1 - / 2 **",
+    "prefix infix - + * 50 2 / 30 10 40",
+    "postfix prefix 10 20 30 * + 40 20 / -",
+};
+
+int connectUnix(const std::string &path) {
+  sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path))
+    throw std::runtime_error("Socket path too long: " + path);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+    std::string err = std::strerror(errno);
+    ::close(fd);
+    throw std::runtime_error("Cannot connect to " + path + ": " + err);
+  }
+  return fd;
+}
+
+void writeAll(int fd, const std::string &data) {
+  size_t offset = 0;
+  while (offset < data.size()) {
+    ssize_t n = ::write(fd, data.data() + offset, data.size() - offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      throw std::runtime_error(std::string("write: ") + std::strerror(errno));
+    offset += static_cast<size_t>(n);
+  }
+}
+
+// Drives a single connection: the calling thread sends, a helper thread
+// receives and matches responses to send timestamps in FIFO order.
+ConnectionResult runConnection(const LoadOptions &options,
+                               const std::vector<std::string> &requests,
+                               size_t count, size_t firstRequest) {
+  int fd = connectUnix(options.socketPath);
+  ConnectionResult result;
+  result.latenciesUs.resize(count);
+  std::unique_ptr<std::atomic<int64_t>[]> sentAt(new std::atomic<int64_t>[count]);
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t inFlight = 0;
+  bool closed = false;
+
+  std::thread receiver([&] {
+    std::string buffer;
+    size_t pos = 0;
+    size_t received = 0;
+    std::vector<char> chunk(1 << 16);
+    bool protocolError = false;
+    while (received < count && !protocolError) {
+      ssize_t n = ::read(fd, chunk.data(), chunk.size());
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      buffer.append(chunk.data(), static_cast<size_t>(n));
+      size_t completed = 0;
+      for (;;) {
+        size_t nl = buffer.find('\n', pos);
+        if (nl == std::string::npos)
+          break;
+        size_t start = nl + 1;
+        size_t end = nl;
+        size_t next = nl + 1;
+        if (options.lengthPrefixed) {
+          size_t length = 0;
+          for (size_t i = pos; i < nl; ++i) {
+            if (!std::isdigit((unsigned char)buffer[i]))
+              protocolError = true;
+            length = length * 10 + static_cast<size_t>(buffer[i] - '0');
+          }
+          if (protocolError || nl == pos) {
+            std::cerr << "Malformed response frame; is the server running with --length-prefixed?\n";
+            protocolError = true;
+            break;
+          }
+          if (buffer.size() - start < length)
+            break;
+          end = start + length;
+          next = end;
+        } else {
+          start = pos;
+        }
+        int64_t now = Clock::now().time_since_epoch().count();
+        result.latenciesUs[received] =
+            static_cast<double>(now - sentAt[received].load(std::memory_order_acquire)) / 1000.0;
+        if (buffer.compare(start, 3, "ok ") != 0 || end - start < 3)
+          ++result.errors;
+        ++received;
+        ++completed;
+        pos = next;
+      }
+      buffer.erase(0, pos);
+      pos = 0;
+      if (completed) {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          inFlight -= completed;
+        }
+        cv.notify_one();
+      }
+    }
+    result.latenciesUs.resize(received);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    cv.notify_one();
+  });
+
+  std::string out;
+  for (size_t sent = 0; sent < count;) {
+    size_t room;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return closed || inFlight < options.window; });
+      if (closed)
+        break;
+      room = std::min(options.window - inFlight, count - sent);
+      inFlight += room;
+    }
+    out.clear();
+    int64_t now = Clock::now().time_since_epoch().count();
+    for (size_t i = 0; i < room; ++i, ++sent) {
+      const std::string &request = requests[(firstRequest + sent) % requests.size()];
+      if (options.lengthPrefixed) {
+        out += std::to_string(request.size());
+        out += '\n';
+        out += request;
+      } else {
+        out += request;
+        out += '\n';
+      }
+      sentAt[sent].store(now, std::memory_order_release);
+    }
+    writeAll(fd, out);
+  }
+  ::shutdown(fd, SHUT_WR);
+  receiver.join();
+  ::close(fd);
+  return result;
+}
+
+LoadOptions parseOptions(int argc, char **argv) {
+  LoadOptions options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc)
+        throw std::runtime_error("Missing value for " + arg);
+      return argv[++i];
+    };
+    if (arg == "--socket") {
+      options.socketPath = value();
+    } else if (arg == "--file") {
+      options.requestFile = value();
+    } else if (arg == "--requests") {
+      options.requests = std::stoul(value());
+    } else if (arg == "--connections") {
+      options.connections = std::max(1u, static_cast<unsigned>(std::stoul(value())));
+    } else if (arg == "--window") {
+      options.window = std::max<size_t>(1, std::stoul(value()));
+    } else if (arg == "--length-prefixed") {
+      options.lengthPrefixed = true;
+    } else {
+      throw std::runtime_error("Unknown option " + arg);
+    }
+  }
+  if (options.socketPath.empty())
+    throw std::runtime_error("--socket is required");
+  return options;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty())
+    return 0.0;
+  size_t index = static_cast<size_t>(p / 100.0 * static_cast<double>(sorted.size() - 1) + 0.5);
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  try {
+    LoadOptions options = parseOptions(argc, argv);
+    std::vector<std::string> requests = defaultRequests;
+    if (!options.requestFile.empty()) {
+      std::ifstream in(options.requestFile);
+      if (!in)
+        throw std::runtime_error("Cannot open " + options.requestFile);
+      requests.clear();
+      for (std::string line; std::getline(in, line);)
+        if (!line.empty())
+          requests.push_back(line);
+      if (requests.empty())
+        throw std::runtime_error("No requests in " + options.requestFile);
+    }
+
+    std::vector<ConnectionResult> results(options.connections);
+    std::vector<std::thread> threads;
+    size_t perConnection = options.requests / options.connections;
+    auto start = Clock::now();
+    for (unsigned c = 0; c < options.connections; ++c) {
+      size_t count = perConnection + (c < options.requests % options.connections ? 1 : 0);
+      threads.emplace_back([&, c, count] {
+        try {
+          results[c] = runConnection(options, requests, count, c * perConnection);
+        } catch (const std::exception &e) {
+          std::cerr << "Connection " << c << " failed: " << e.what() << '\n';
+        }
+      });
+    }
+    for (auto &t : threads)
+      t.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<double> latencies;
+    size_t errors = 0;
+    for (auto &r : results) {
+      latencies.insert(latencies.end(), r.latenciesUs.begin(), r.latenciesUs.end());
+      errors += r.errors;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "Requests:    " << latencies.size() << " (" << errors << " errors)\n";
+    std::cout << "Elapsed:     " << seconds << " s\n";
+    std::cout << "Throughput:  " << static_cast<double>(latencies.size()) / seconds << " req/s\n";
+    std::cout << "Latency (us) p50: " << percentile(latencies, 50)
+              << "  p90: " << percentile(latencies, 90)
+              << "  p99: " << percentile(latencies, 99)
+              << "  p99.9: " << percentile(latencies, 99.9)
+              << "  max: " << (latencies.empty() ? 0.0 : latencies.back()) << '\n';
+    return latencies.size() == options.requests ? 0 : 1;
+  } catch (const std::exception &e) {
+    std::cerr << "expressionLoadGenerator: " << e.what() << '\n';
+    return 1;
+  }
+}
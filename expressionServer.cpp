@@ -0,0 +1,461 @@
+// Long-running expression evaluation server.
+//
+// Reads requests of the form "<notation> <operation> <expression>" (see
+// ExpressionRequestProcessor) from stdin or from clients connected to a Unix
+// domain socket. Requests are either newline delimited or, with
+// --length-prefixed, framed as "<byte count>\n<payload>". Pipelined requests
+// are grouped into batches, processed on a pool of worker threads and the
+// responses are streamed back in request order as "ok <result>" or
+// "error <message>" using the same framing as the requests.
+//
+// The --max-* options limit each request (see ExpressionLimits); a request
+// over a limit gets an error response and the server carries on. A request
+// too large for --max-bytes is discarded as it arrives, never buffered.
+//
+// Usage:
+//   expressionServer [--socket PATH] [--threads N] [--batch N]
+//                    [--length-prefixed] [--max-bytes N] [--max-tokens N]
+//                    [--max-depth N] [--max-output N] [--max-steps N]
+//                    [--max-time-ms N]
+#include "mathExpressionsHandling.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Largest length-prefixed frame accepted; a bigger header is a protocol
+// error. Ten digits are enough to write it.
+constexpr size_t maxFrameBytes = size_t(1) << 30;
+constexpr size_t maxHeaderDigits = 10;
+
+struct ServerOptions {
+  std::string socketPath;          // Empty means stdin/stdout.
+  unsigned threads = 0;            // 0 means hardware concurrency.
+  size_t maxBatch = 256;           // Requests per batch handed to a worker.
+  size_t maxPendingBatches = 64;   // Per-connection backpressure limit.
+  bool lengthPrefixed = false;
+  ExpressionLimits limits;         // Per request.
+};
+
+struct Batch {
+  std::vector<std::string> requests;
+  std::vector<std::string> responses;
+  // Requests the reader answered itself, by index; their text is empty.
+  std::vector<std::pair<size_t, std::string>> rejected;
+  bool done = false;
+};
+
+class Session;
+
+// Fixed pool of threads processing batches from any session.
+class WorkerPool {
+public:
+  WorkerPool(unsigned threads, const ExpressionLimits &limits) : processor(limits) {
+    for (unsigned i = 0; i < threads; ++i)
+      workers.emplace_back([this] { run(); });
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto &t : workers)
+      t.join();
+  }
+
+  void submit(std::shared_ptr<Session> session, std::shared_ptr<Batch> batch) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.emplace_back(std::move(session), std::move(batch));
+    }
+    cv.notify_one();
+  }
+
+private:
+  void run();
+
+  ExpressionRequestProcessor processor;
+  std::vector<std::thread> workers;
+  std::deque<std::pair<std::shared_ptr<Session>, std::shared_ptr<Batch>>> jobs;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stopping = false;
+};
+
+// One client stream. The reader splits incoming bytes into requests and
+// submits batches; the writer emits finished batches strictly in the order
+// they were submitted, so responses always match request order.
+class Session : public std::enable_shared_from_this<Session> {
+public:
+  Session(int inFd, int outFd, const ServerOptions &options, WorkerPool &pool)
+      : inFd(inFd), outFd(outFd), options(options), pool(pool) {}
+
+  void run() {
+    std::thread writer([self = shared_from_this()] { self->writeLoop(); });
+    readLoop();
+    writer.join();
+  }
+
+  void complete(const std::shared_ptr<Batch> &batch) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      batch->done = true;
+    }
+    cv.notify_all();
+  }
+
+private:
+  void readLoop() {
+    std::string buffer;
+    size_t parsed = 0;
+    std::vector<char> chunk(1 << 16);
+    auto batch = std::make_shared<Batch>();
+    for (;;) {
+      ssize_t n = ::read(inFd, chunk.data(), chunk.size());
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      buffer.append(chunk.data(), static_cast<size_t>(n));
+
+      std::string request, error;
+      bool corrupt = false;
+      try {
+        while (nextFrame(buffer, parsed, request, error)) {
+          if (!error.empty()) {
+            batch->rejected.emplace_back(batch->requests.size(), std::move(error));
+            error.clear(); // Moved-from strings are not guaranteed empty.
+          }
+          batch->requests.push_back(std::move(request));
+          if (batch->requests.size() >= options.maxBatch) {
+            submit(batch);
+            batch = std::make_shared<Batch>();
+          }
+        }
+      } catch (const std::runtime_error &e) {
+        std::cerr << "Dropping connection: " << e.what() << '\n';
+        corrupt = true;
+      }
+      // Nothing more is buffered right now: hand off what we have instead of
+      // waiting for a full batch, so a lone request is not delayed.
+      if (!batch->requests.empty()) {
+        submit(batch);
+        batch = std::make_shared<Batch>();
+      }
+      if (corrupt) {
+        buffer.clear();
+        parsed = 0;
+        break;
+      }
+      buffer.erase(0, parsed);
+      parsed = 0;
+    }
+    // A trailing line without a newline is still a request.
+    if (!options.lengthPrefixed && (overlong || parsed < buffer.size())) {
+      if (overlong)
+        batch->rejected.emplace_back(batch->requests.size(), tooLarge(overlong + buffer.size() - parsed));
+      batch->requests.push_back(overlong ? std::string() : buffer.substr(parsed));
+      submit(batch);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      readerDone = true;
+    }
+    cv.notify_all();
+  }
+
+  // Same text as the library's own input check.
+  std::string tooLarge(size_t bytes) const {
+    return "Input too large: " + std::to_string(bytes) + " bytes, the limit is " +
+           std::to_string(options.limits.maxInputBytes) + ".";
+  }
+
+  // Extracts the next complete request starting at 'pos'. Returns false when
+  // the buffer does not hold a complete frame yet. A request that cannot
+  // fit --max-bytes is not buffered: its bytes are dropped as they arrive
+  // and it comes back as an empty request with 'error' set.
+  bool nextFrame(const std::string &buffer, size_t &pos, std::string &out, std::string &error) {
+    // The limit is on the expression; leave room for "<notation> <operation> ".
+    const size_t limit = options.limits.maxInputBytes ? options.limits.maxInputBytes + 64 : 0;
+    for (;;) {
+      if (skip > 0) {
+        size_t n = std::min(skip, buffer.size() - pos);
+        pos += n;
+        skip -= n;
+        if (skip > 0)
+          return false;
+      }
+      size_t nl = buffer.find('\n', pos);
+      size_t headerEnd = nl == std::string::npos ? buffer.size() : nl;
+      if (options.lengthPrefixed && headerEnd - pos > maxHeaderDigits)
+        throw std::runtime_error("Invalid frame header.");
+      if (nl == std::string::npos) {
+        // One more byte than the limit may be a '\r' before the newline.
+        if (!options.lengthPrefixed && limit && (overlong || buffer.size() - pos > limit + 1)) {
+          overlong += buffer.size() - pos;
+          pos = buffer.size();
+        }
+        return false;
+      }
+      if (!options.lengthPrefixed) {
+        size_t end = nl;
+        if (end > pos && buffer[end - 1] == '\r')
+          --end;
+        if (overlong) {
+          out.clear();
+          error = tooLarge(overlong + (end - pos));
+          overlong = 0;
+          pos = nl + 1;
+          return true;
+        }
+        if (end == pos) { // Skip blank lines.
+          pos = nl + 1;
+          continue;
+        }
+        out.assign(buffer, pos, end - pos);
+        pos = nl + 1;
+        return true;
+      }
+      size_t length = 0;
+      for (size_t i = pos; i < nl; ++i) {
+        if (!std::isdigit((unsigned char)buffer[i]))
+          throw std::runtime_error("Invalid frame header.");
+        size_t digit = static_cast<size_t>(buffer[i] - '0');
+        if (length > (maxFrameBytes - digit) / 10)
+          throw std::runtime_error("Frame too large: the limit is " + std::to_string(maxFrameBytes) + " bytes.");
+        length = length * 10 + digit;
+      }
+      if (limit && length > limit) {
+        out.clear();
+        error = tooLarge(length);
+        skip = length;
+        pos = nl + 1;
+        return true;
+      }
+      if (buffer.size() - (nl + 1) < length)
+        return false;
+      out.assign(buffer, nl + 1, length);
+      pos = nl + 1 + length;
+      return true;
+    }
+  }
+
+  void submit(const std::shared_ptr<Batch> &batch) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return pending.size() < options.maxPendingBatches; });
+      pending.push_back(batch);
+    }
+    pool.submit(shared_from_this(), batch);
+  }
+
+  void writeLoop() {
+    std::string out;
+    bool writable = true;
+    for (;;) {
+      std::vector<std::shared_ptr<Batch>> ready;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] {
+          return (!pending.empty() && pending.front()->done) ||
+                 (readerDone && pending.empty());
+        });
+        if (pending.empty())
+          break;
+        while (!pending.empty() && pending.front()->done) {
+          ready.push_back(std::move(pending.front()));
+          pending.pop_front();
+        }
+      }
+      cv.notify_all(); // Wake a reader blocked on backpressure.
+
+      out.clear();
+      for (const auto &batch : ready) {
+        for (const auto &response : batch->responses) {
+          if (options.lengthPrefixed) {
+            out += std::to_string(response.size());
+            out += '\n';
+            out += response;
+          } else {
+            out += response;
+            out += '\n';
+          }
+        }
+      }
+      // Keep draining after the peer goes away so the reader never blocks.
+      if (writable)
+        writable = writeAll(out);
+    }
+  }
+
+  bool writeAll(const std::string &data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+      ssize_t n = ::write(outFd, data.data() + offset, data.size() - offset);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      offset += static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  int inFd;
+  int outFd;
+  const ServerOptions &options;
+  WorkerPool &pool;
+  size_t skip = 0;     // Bytes left of an oversized length-prefixed frame.
+  size_t overlong = 0; // Bytes so far of an oversized line; 0 if none.
+  std::deque<std::shared_ptr<Batch>> pending;
+  bool readerDone = false;
+  std::mutex mutex;
+  std::condition_variable cv;
+};
+
+void WorkerPool::run() {
+  for (;;) {
+    std::pair<std::shared_ptr<Session>, std::shared_ptr<Batch>> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return stopping || !jobs.empty(); });
+      if (jobs.empty())
+        return;
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    Batch &batch = *job.second;
+    batch.responses.reserve(batch.requests.size());
+    auto rejected = batch.rejected.begin();
+    for (const auto &request : batch.requests) {
+      if (rejected != batch.rejected.end() && rejected->first == batch.responses.size()) {
+        batch.responses.push_back("error " + rejected->second);
+        ++rejected;
+        continue;
+      }
+      try {
+        std::string response = "ok ";
+        processor.process(request, response);
+        batch.responses.push_back(std::move(response));
+      } catch (const std::exception &e) {
+        std::string message = e.what();
+        std::replace(message.begin(), message.end(), '\n', ' ');
+        batch.responses.push_back("error " + message);
+      }
+    }
+    job.first->complete(job.second);
+  }
+}
+
+ServerOptions parseOptions(int argc, char **argv) {
+  ServerOptions options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc)
+        throw std::runtime_error("Missing value for " + arg);
+      return argv[++i];
+    };
+    if (arg == "--socket") {
+      options.socketPath = value();
+    } else if (arg == "--threads") {
+      options.threads = static_cast<unsigned>(std::stoul(value()));
+    } else if (arg == "--batch") {
+      options.maxBatch = std::max<size_t>(1, std::stoul(value()));
+    } else if (arg == "--length-prefixed") {
+      options.lengthPrefixed = true;
+    } else if (arg == "--max-bytes") {
+      options.limits.maxInputBytes = std::stoul(value());
+    } else if (arg == "--max-tokens") {
+      options.limits.maxTokens = std::stoul(value());
+    } else if (arg == "--max-depth") {
+      options.limits.maxDepth = std::stoul(value());
+    } else if (arg == "--max-output") {
+      options.limits.maxOutputBytes = std::stoul(value());
+    } else if (arg == "--max-steps") {
+      options.limits.maxSteps = std::stoul(value());
+    } else if (arg == "--max-time-ms") {
+      options.limits.maxTime = std::chrono::milliseconds(std::stoul(value()));
+    } else {
+      throw std::runtime_error("Unknown option " + arg);
+    }
+  }
+  if (options.threads == 0)
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+  return options;
+}
+
+int listenUnix(const std::string &path) {
+  sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path))
+    throw std::runtime_error("Socket path too long: " + path);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  ::unlink(path.c_str());
+  if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      ::listen(fd, 128) < 0) {
+    std::string err = std::strerror(errno);
+    ::close(fd);
+    throw std::runtime_error("Cannot listen on " + path + ": " + err);
+  }
+  return fd;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::signal(SIGPIPE, SIG_IGN);
+  try {
+    ServerOptions options = parseOptions(argc, argv);
+    WorkerPool pool(options.threads, options.limits);
+
+    if (options.socketPath.empty()) {
+      std::make_shared<Session>(STDIN_FILENO, STDOUT_FILENO, options, pool)->run();
+      return 0;
+    }
+
+    int listenFd = listenUnix(options.socketPath);
+    std::cerr << "Listening on " << options.socketPath << " with "
+              << options.threads << " worker threads\n";
+    for (;;) {
+      int client = ::accept(listenFd, nullptr, nullptr);
+      if (client < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::runtime_error(std::string("accept: ") + std::strerror(errno));
+      }
+      std::thread([client, &options, &pool] {
+        try {
+          std::make_shared<Session>(client, client, options, pool)->run();
+        } catch (const std::exception &e) {
+          std::cerr << "Connection closed: " << e.what() << '\n';
+        }
+        ::close(client);
+      }).detach();
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "expressionServer: " << e.what() << '\n';
+    return 1;
+  }
+}
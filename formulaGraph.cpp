@@ -0,0 +1,262 @@
+#include "formulaGraph.hpp"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+// Levels smaller than this are evaluated on the calling thread; starting
+// threads would cost more than the work itself.
+constexpr size_t parallelLevelThreshold = 4096;
+} // namespace
+
+FormulaGraph::CellId FormulaGraph::cellId(const std::string &name) {
+  auto it = names.find(name);
+  if (it != names.end()) {
+    return it->second;
+  }
+  CellId id = static_cast<CellId>(cells.size());
+  cells.emplace_back();
+  cells.back().name = name;
+  values.push_back(0.0);
+  marks.push_back(0);
+  names.emplace(name, id);
+  return id;
+}
+
+void FormulaGraph::detachDependencies(CellId id) {
+  for (CellId dep : cells[id].dependencies) {
+    auto &list = cells[dep].dependents;
+    list.erase(std::find(list.begin(), list.end(), id));
+  }
+  cells[id].dependencies.clear();
+  cells[id].program = ExpressionProgram();
+}
+
+void FormulaGraph::markDirty(CellId id) {
+  if (!cells[id].dirty) {
+    cells[id].dirty = true;
+    dirtyCells.push_back(id);
+  }
+}
+
+// Marks 'from' and every cell that depends on it, directly or transitively,
+// with a new epoch. A cell that does not exist yet has no dependents.
+void FormulaGraph::markDependents(CellId from) {
+  ++epoch;
+  if (from >= cells.size()) {
+    return;
+  }
+  std::vector<CellId> st{from};
+  marks[from] = epoch;
+  while (!st.empty()) {
+    CellId id = st.back();
+    st.pop_back();
+    for (CellId next : cells[id].dependents) {
+      if (marks[next] != epoch) {
+        marks[next] = epoch;
+        st.push_back(next);
+      }
+    }
+  }
+}
+
+void FormulaGraph::setValue(const std::string &name, double value) {
+  if (!isIdentifier(name)) {
+    throw std::runtime_error("Invalid cell name '" + name + "'.");
+  }
+  CellId id = cellId(name);
+  Cell &cell = cells[id];
+  detachDependencies(id);
+  cell.defined = true;
+  cell.isFormula = false;
+  values[id] = value;
+  cell.error.clear();
+  markDirty(id);
+}
+
+void FormulaGraph::setFormula(const std::string &name, const std::string &infix) {
+  if (!isIdentifier(name)) {
+    throw std::runtime_error("Invalid cell name '" + name + "'.");
+  }
+  // Compile before touching the graph so that a bad formula changes nothing.
+  // Names without a cell get the ids their cells will have once the
+  // formula is accepted.
+  std::unordered_map<std::string, CellId> added;
+  auto lookup = [&](const std::string &ref) {
+    auto it = names.find(ref);
+    if (it != names.end()) {
+      return it->second;
+    }
+    CellId next = static_cast<CellId>(cells.size() + added.size());
+    return added.emplace(ref, next).first->second;
+  };
+  std::vector<Token> postfix = parsePostfix("infix", infix);
+  std::vector<CellId> dependencies;
+  for (Token &tok : postfix) {
+    if (tok.type == Token::Cell) {
+      tok.slot = lookup(std::string(tok.text));
+      dependencies.push_back(tok.slot);
+    }
+  }
+  ExpressionProgram program = ExpressionProgram::compile(postfix, "infix", true);
+  std::sort(dependencies.begin(), dependencies.end());
+  dependencies.erase(std::unique(dependencies.begin(), dependencies.end()), dependencies.end());
+
+  // One walk finds every cell that depends on this one; reading any of
+  // them would close a cycle.
+  CellId id = lookup(name);
+  markDependents(id);
+  for (CellId dep : dependencies) {
+    if (dep == id || (dep < cells.size() && marks[dep] == epoch)) {
+      const std::string &through = dep == id ? name : cells[dep].name;
+      throw std::runtime_error("Circular reference: formula for '" + name +
+                               "' depends on itself through '" + through + "'.");
+    }
+  }
+
+  std::vector<const std::string *> order(added.size());
+  for (const auto &entry : added) {
+    order[entry.second - cells.size()] = &entry.first;
+  }
+  for (const std::string *ref : order) {
+    cellId(*ref);
+  }
+  detachDependencies(id);
+  Cell &cell = cells[id];
+  cell.defined = true;
+  cell.isFormula = true;
+  cell.program = std::move(program);
+  cell.dependencies = std::move(dependencies);
+  for (CellId dep : cell.dependencies) {
+    cells[dep].dependents.push_back(id);
+  }
+  markDirty(id);
+}
+
+double FormulaGraph::getValue(const std::string &name) const {
+  auto it = names.find(name);
+  if (it == names.end() || !cells[it->second].defined) {
+    throw std::runtime_error("Unknown cell '" + name + "'.");
+  }
+  const Cell &cell = cells[it->second];
+  if (!cell.error.empty()) {
+    throw std::runtime_error(cell.error);
+  }
+  return values[it->second];
+}
+
+void FormulaGraph::evaluateCell(CellId id) {
+  Cell &cell = cells[id];
+  cell.error.clear();
+  try {
+    for (CellId dep : cell.dependencies) {
+      const Cell &ref = cells[dep];
+      if (!ref.defined) {
+        throw std::runtime_error("Unknown cell '" + ref.name + "'.");
+      }
+      if (!ref.error.empty()) {
+        throw std::runtime_error("Error in referenced cell '" + ref.name + "'.");
+      }
+    }
+    values[id] = cell.program.run(values.data());
+  } catch (const std::runtime_error &e) {
+    cell.error = "Cell '" + cell.name + "': " + e.what();
+  }
+}
+
+size_t FormulaGraph::recalculate(unsigned threads) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // Everything downstream of a changed cell needs recomputing.
+  ++epoch;
+  std::vector<CellId> affected;
+  for (CellId id : dirtyCells) {
+    if (marks[id] != epoch) {
+      marks[id] = epoch;
+      affected.push_back(id);
+    }
+  }
+  for (size_t i = 0; i < affected.size(); ++i) {
+    for (CellId next : cells[affected[i]].dependents) {
+      if (marks[next] != epoch) {
+        marks[next] = epoch;
+        affected.push_back(next);
+      }
+    }
+  }
+  for (CellId id : dirtyCells) {
+    cells[id].dirty = false;
+  }
+  dirtyCells.clear();
+
+  // Kahn's algorithm restricted to the affected cells: a cell is ready once
+  // all of its affected dependencies have been computed.
+  std::unique_ptr<std::atomic<std::uint32_t>[]> pending(
+      new std::atomic<std::uint32_t>[cells.size()]);
+  std::vector<CellId> level;
+  for (CellId id : affected) {
+    std::uint32_t count = 0;
+    for (CellId dep : cells[id].dependencies) {
+      count += marks[dep] == epoch;
+    }
+    pending[id].store(count, std::memory_order_relaxed);
+    if (count == 0) {
+      level.push_back(id);
+    }
+  }
+
+  size_t processed = 0;
+  size_t evaluated = 0;
+  std::vector<std::vector<CellId>> nextLevels(threads);
+  std::vector<size_t> evaluatedPerThread(threads);
+  while (!level.empty()) {
+    auto work = [&](unsigned worker, size_t begin, size_t end) {
+      auto &next = nextLevels[worker];
+      for (size_t i = begin; i < end; ++i) {
+        CellId id = level[i];
+        if (cells[id].isFormula) {
+          evaluateCell(id);
+          ++evaluatedPerThread[worker];
+        }
+        for (CellId dependent : cells[id].dependents) {
+          if (pending[dependent].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            next.push_back(dependent);
+          }
+        }
+      }
+    };
+
+    unsigned used = level.size() < parallelLevelThreshold ? 1u : threads;
+    size_t per = (level.size() + used - 1) / used;
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < used; ++t) {
+      size_t begin = std::min(level.size(), t * per);
+      pool.emplace_back(work, t, begin, std::min(level.size(), begin + per));
+    }
+    work(0, 0, std::min(level.size(), per));
+    for (auto &thread : pool) {
+      thread.join();
+    }
+
+    processed += level.size();
+    level.clear();
+    for (auto &next : nextLevels) {
+      level.insert(level.end(), next.begin(), next.end());
+      next.clear();
+    }
+  }
+  for (size_t count : evaluatedPerThread) {
+    evaluated += count;
+  }
+
+  if (processed != affected.size()) {
+    throw std::runtime_error("Circular reference detected during recalculation.");
+  }
+  return evaluated;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "mathExpressionsHandling.hpp"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Spreadsheet-style graph of named cells. A cell holds either an input value
+// or an infix formula that may refer to other cells by name, e.g.
+//   graph.setValue("price", 12.5);
+//   graph.setFormula("total", "price * qty + shipping");
+// Formulas are compiled once when set. The graph tracks which cells depend
+// on which and rejects formulas that would create a cycle. recalculate()
+// recomputes only the cells affected by changes since the last call, one
+// topological level at a time, spreading each level across threads. The
+// inherited 'limits' apply to parsing each formula.
+class FormulaGraph : public ExpressionParser {
+public:
+  using CellId = std::uint32_t;
+
+  void setValue(const std::string &name, double value);
+  // Throws std::runtime_error on syntax errors or circular references; the
+  // cell keeps its previous contents in that case.
+  void setFormula(const std::string &name, const std::string &infix);
+
+  // Value as of the last recalculate(). Throws std::runtime_error if the
+  // cell is unknown or its formula failed (e.g. division by zero).
+  double getValue(const std::string &name) const;
+
+  // Recomputes every formula that depends, directly or transitively, on a
+  // cell changed since the last call. threads == 0 uses all cores. Returns
+  // the number of formulas evaluated.
+  size_t recalculate(unsigned threads = 0);
+
+  size_t size() const { return cells.size(); }
+
+private:
+  struct Cell {
+    std::string name;
+    bool defined = false;
+    bool isFormula = false;
+    bool dirty = false;
+    std::string error; // Non-empty when the last evaluation failed.
+    ExpressionProgram program; // Loads cell values by CellId.
+    std::vector<CellId> dependencies; // Distinct cells the formula reads.
+    std::vector<CellId> dependents;   // Formulas that read this cell.
+  };
+
+  CellId cellId(const std::string &name);
+  void detachDependencies(CellId id);
+  void markDirty(CellId id);
+  void markDependents(CellId from);
+  void evaluateCell(CellId id);
+
+  std::vector<Cell> cells;
+  std::vector<double> values; // Indexed by CellId; the programs' slots.
+  std::unordered_map<std::string, CellId> names;
+  std::vector<CellId> dirtyCells;
+  // Scratch state for graph walks; a cell is "visited" when its mark equals
+  // the current epoch, which saves clearing the array on every walk.
+  std::vector<std::uint32_t> marks;
+  std::uint32_t epoch = 0;
+};
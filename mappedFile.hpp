@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only private mapping of a whole file.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) {
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+      ::close(fd);
+      throw std::runtime_error("Cannot stat " + path + ": " + std::strerror(errno));
+    }
+    length = static_cast<size_t>(st.st_size);
+    if (length == 0)
+      return;
+    void *p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      ::close(fd);
+      throw std::runtime_error("Cannot map " + path + ": " + std::strerror(errno));
+    }
+    ::madvise(p, length, MADV_SEQUENTIAL);
+    data = static_cast<const char *>(p);
+  }
+
+  ~MappedFile() {
+    if (data)
+      ::munmap(const_cast<char *>(data), length);
+    ::close(fd);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *begin() const { return data; }
+  const char *end() const { return data + length; }
+  size_t size() const { return length; }
+
+private:
+  int fd = -1;
+  const char *data = nullptr;
+  size_t length = 0;
+};
@@ -1,15 +1,23 @@
 #include "mathExpressionsHandling.hpp"
 #include <algorithm>
 #include <cctype>
+#include <charconv>
+#include <chrono>
 #include <cmath>
-#include <stack>
+#include <cstdint>
+#include <limits>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
-static std::vector<std::string> tokenize(const std::string &expr) {
-  std::vector<std::string> tokens;
-  for (size_t i = 0; i < expr.size();) {
+// Calls emit(begin, length) for every token of expr, in order.
+// Emits the tokens that start in [begin, end); the last one may run past
+// 'end'. Returns the position after the last token, or 'end'.
+template <typename Emit> static size_t scan(const std::string &expr, size_t begin, size_t end, Emit emit) {
+  size_t i = begin;
+  while (i < end) {
     if (std::isspace((unsigned char)expr[i])) {
       ++i;
       continue;
@@ -24,7 +32,20 @@ static std::vector<std::string> tokenize(const std::string &expr) {
                                std::isdigit((unsigned char)expr[i + 1]) &&
                                (i == 0 || (!std::isdigit((unsigned char)expr[i-1]) && expr[i-1] != '.')));
 
-    if (std::isdigit((unsigned char)expr[i]) || can_start_with_dot) {
+    if (std::isalpha((unsigned char)expr[i]) || expr[i] == '_') {
+      // Named cell reference: a letter or '_' followed by letters, digits or '_'.
+      size_t j = i + 1;
+      while (j < expr.size() && (std::isalnum((unsigned char)expr[j]) || expr[j] == '_'))
+        ++j;
+      // Arity-tagged function call of postfix and prefix input, e.g. "max@3".
+      if (j + 1 < expr.size() && expr[j] == '@' && std::isdigit((unsigned char)expr[j + 1])) {
+        j += 2;
+        while (j < expr.size() && std::isdigit((unsigned char)expr[j]))
+          ++j;
+      }
+      emit(i, j - i);
+      i = j;
+    } else if (std::isdigit((unsigned char)expr[i]) || can_start_with_dot) {
       size_t j = i;
       bool hasDecimal = false;
       
@@ -39,29 +60,36 @@ static std::vector<std::string> tokenize(const std::string &expr) {
           break;
         }
       }
-      tokens.emplace_back(expr.substr(i, j - i));
+      emit(i, j - i);
       i = j;
     } else {
-      if (expr[i] == '*' && i + 1 < expr.size() && expr[i + 1] == '*') {
-        tokens.emplace_back("**");
-        i += 2;
-      } else {
-        tokens.emplace_back(std::string(1, expr[i]));
+      static const char *twoCharOperators[] = {"**", "<=", ">=", "==", "!=", "&&", "||"};
+      bool matched = false;
+      for (const char *op : twoCharOperators) {
+        if (expr[i] == op[0] && i + 1 < expr.size() && expr[i + 1] == op[1]) {
+          emit(i, 2);
+          i += 2;
+          matched = true;
+          break;
+        }
+      }
+      if (!matched) {
+        emit(i, 1);
         ++i;
       }
     }
   }
-  return tokens;
+  return i;
 }
 
-static std::string join(const std::vector<std::string> &tokens) {
-  std::string out;
-  for (size_t i = 0; i < tokens.size(); ++i) {
-    out += tokens[i];
-    if (i + 1 < tokens.size())
-      out += ' ';
-  }
-  return out;
+template <typename Emit> static void scan(const std::string &expr, Emit emit) {
+  scan(expr, 0, expr.size(), emit);
+}
+
+std::vector<std::string> ExpressionParser::tokenize(const std::string &expr) {
+  std::vector<std::string> tokens;
+  scan(expr, [&](size_t begin, size_t length) { tokens.emplace_back(expr, begin, length); });
+  return tokens;
 }
 
 template <typename T> bool isNum(const T &expression) {
@@ -89,6 +117,69 @@ template <typename T> bool isNum(const T &expression) {
   return hasDigit; // Must have at least one digit
 }
 template bool isNum<std::string>(const std::string &);
+template bool isNum<std::string_view>(const std::string_view &);
+
+template <typename T> bool isIdentifier(const T &expression) {
+  if (expression.empty() ||
+      !(std::isalpha(static_cast<unsigned char>(expression[0])) || expression[0] == '_')) {
+    return false;
+  }
+  for (char c : expression) {
+    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_') {
+      return false;
+    }
+  }
+  return true;
+}
+template bool isIdentifier<std::string>(const std::string &);
+template bool isIdentifier<std::string_view>(const std::string_view &);
+
+
+bool ExpressionParser::isConditional(const std::string &tok) {
+  return tok == "if";
+}
+
+bool ExpressionParser::isCellReference(const std::string &tok) {
+  return isIdentifier(tok) && !isConditional(tok);
+}
+
+bool ExpressionParser::isOperand(const std::string &tok) {
+  return isNum(tok) || isCellReference(tok);
+}
+
+static const MathFunction *resolveCall(std::string_view tok, std::uint32_t &arity) {
+  size_t at = tok.find('@');
+  if (at == std::string::npos || at + 1 == tok.size() || at + 10 < tok.size())
+    return nullptr;
+  std::uint32_t count = 0;
+  for (size_t i = at + 1; i < tok.size(); ++i) {
+    if (!std::isdigit((unsigned char)tok[i]))
+      return nullptr;
+    count = count * 10 + static_cast<std::uint32_t>(tok[i] - '0');
+  }
+  const MathFunction *function = findFunction(tok.substr(0, at));
+  if (!function || count < function->minArgs || count > function->maxArgs)
+    return nullptr;
+  arity = count;
+  return function;
+}
+
+const MathFunction *ExpressionParser::getCall(const std::string &tok, std::uint32_t &arity) {
+  return resolveCall(tok, arity);
+}
+
+int ExpressionParser::getArity(const std::string &tok) const {
+  if (isOperand(tok))
+    return 0;
+  if (opHandling.isOperator(tok))
+    return 2;
+  if (isConditional(tok))
+    return 3;
+  std::uint32_t arity;
+  if (getCall(tok, arity))
+    return static_cast<int>(arity);
+  return -1;
+}
 
 bool OperatorsHandling::isOperator(const std::string &expr) const {
   return operatorsPriority.find(expr) != operatorsPriority.end();
@@ -101,351 +192,1419 @@ int OperatorsHandling::getOperatorPriority(const std::string &expr) const {
   return it->second;
 }
 
-std::map<std::string, int> OperatorsHandling::operatorsPriority = {
-    {"+", 1}, {"-", 1}, {"*", 2}, {"/", 2}, {"^", 3}, {"**", 3}};
+int OperatorsHandling::getOperatorPriority(OperatorKind kind) const {
+  // Indexed by OperatorKind; derived from the symbol tables once.
+  static const std::vector<int> byKind = [] {
+    std::vector<int> table(static_cast<size_t>(OperatorKind::Conditional) + 1, -1);
+    for (const auto &entry : operatorsPriority)
+      table[static_cast<size_t>(operatorsKind.find(entry.first)->second)] = entry.second;
+    return table;
+  }();
+  return byKind[static_cast<size_t>(kind)];
+}
 
-std::string ExpressionConverter::infixToPostfix(const std::string &expr) const {
-  auto tokens = tokenize(expr);
-  std::vector<std::string> output;
-  std::stack<std::string> ops;
-  for (const auto &tok : tokens) { // Use const auto&
-    if (isNum(tok)) {
-      output.push_back(tok);
-    } else if (opHandling.isOperator(tok)) {
-      // "^" and "**" are right-associative. Others are mostly left-associative.
-      // Standard shunting-yard:
-      // while (op_on_stack is operator AND
-      //        (op_on_stack has greater precedence than tok OR
-      //         (op_on_stack has equal precedence as tok AND tok is left-associative (not right))))
-      // For simplicity, we'll use getOperatorPriority for comparisons.
-      // ^ and ** are right associative, all others left.
-      bool currentIsRightAssociative = (tok == "^" || tok == "**");
-      while (!ops.empty() && ops.top() != "(" && opHandling.isOperator(ops.top())) {
-        int prec_current = opHandling.getOperatorPriority(tok);
-        int prec_stack = opHandling.getOperatorPriority(ops.top());
-        bool stackIsRightAssociative = (ops.top() == "^" || ops.top() == "**"); // Not strictly needed here but good for clarity
-
-        if ((!currentIsRightAssociative && prec_stack >= prec_current) || (currentIsRightAssociative && prec_stack > prec_current)) {
-          output.push_back(ops.top());
-          ops.pop();
-        } else {
-          break; // Lower precedence or right-associative handling
-        }
-      }
-      ops.push(tok);
-    } else if (tok == "(") {
-      ops.push(tok);
-    } else if (tok == ")") {
-      while (!ops.empty() && ops.top() != "(") {
-        output.push_back(ops.top());
-        ops.pop();
-      }
-      if (ops.empty()) {
-        throw std::runtime_error("Invalid infix expression: Mismatched parentheses - no matching '('.");
+const std::string &OperatorsHandling::getOperatorSymbol(OperatorKind kind) {
+  static const std::vector<std::string> byKind = [] {
+    std::vector<std::string> table(static_cast<size_t>(OperatorKind::Conditional) + 1);
+    for (const auto &entry : operatorsKind) {
+      auto &symbol = table[static_cast<size_t>(entry.second)];
+      if (symbol.empty() || entry.first.size() > symbol.size())
+        symbol = entry.first; // "**" rather than "^".
+    }
+    return table;
+  }();
+  return byKind[static_cast<size_t>(kind)];
+}
+
+OperatorKind OperatorsHandling::getOperatorKind(std::string_view expr) const {
+  auto it = operatorsKind.find(expr);
+  if (it == operatorsKind.end())
+    return OperatorKind::None;
+  return it->second;
+}
+
+double applyOperator(OperatorKind kind, double a, double b) {
+  switch (kind) {
+  case OperatorKind::Add:
+    return a + b;
+  case OperatorKind::Subtract:
+    return a - b;
+  case OperatorKind::Multiply:
+    return a * b;
+  case OperatorKind::Divide:
+    if (b == 0.0) {
+      throw std::runtime_error("Division by zero");
+    }
+    return a / b;
+  case OperatorKind::Power:
+    return std::pow(a, b);
+  case OperatorKind::Less:
+    return a < b ? 1.0 : 0.0;
+  case OperatorKind::LessEqual:
+    return a <= b ? 1.0 : 0.0;
+  case OperatorKind::Greater:
+    return a > b ? 1.0 : 0.0;
+  case OperatorKind::GreaterEqual:
+    return a >= b ? 1.0 : 0.0;
+  case OperatorKind::Equal:
+    return a == b ? 1.0 : 0.0;
+  case OperatorKind::NotEqual:
+    return a != b ? 1.0 : 0.0;
+  case OperatorKind::And:
+    return (a != 0.0 && b != 0.0) ? 1.0 : 0.0;
+  case OperatorKind::Or:
+    return (a != 0.0 || b != 0.0) ? 1.0 : 0.0;
+  case OperatorKind::Conditional:
+  case OperatorKind::None:
+    break;
+  }
+  throw std::runtime_error("Unknown operator");
+}
+
+namespace {
+double callSqrt(const double *args, std::uint32_t) {
+  if (args[0] < 0.0) {
+    throw std::runtime_error("Square root of a negative number");
+  }
+  return std::sqrt(args[0]);
+}
+
+double callAbs(const double *args, std::uint32_t) { return std::fabs(args[0]); }
+
+double callExp(const double *args, std::uint32_t) { return std::exp(args[0]); }
+
+double callLog(const double *args, std::uint32_t) {
+  if (args[0] <= 0.0) {
+    throw std::runtime_error("Logarithm of a non-positive number");
+  }
+  return std::log(args[0]);
+}
+
+double callMin(const double *args, std::uint32_t count) {
+  return *std::min_element(args, args + count);
+}
+
+double callMax(const double *args, std::uint32_t count) {
+  return *std::max_element(args, args + count);
+}
+
+// The batch kernels check the whole column first, so the arithmetic loop
+// has no branches and vectorizes.
+void batchSqrt(const double *const *columns, std::uint32_t, double *out, size_t rows) {
+  const double *x = columns[0];
+  bool negative = false;
+  for (size_t r = 0; r < rows; ++r)
+    negative |= x[r] < 0.0;
+  if (negative) {
+    throw std::runtime_error("Square root of a negative number");
+  }
+  for (size_t r = 0; r < rows; ++r)
+    out[r] = std::sqrt(x[r]);
+}
+
+void batchAbs(const double *const *columns, std::uint32_t, double *out, size_t rows) {
+  const double *x = columns[0];
+  for (size_t r = 0; r < rows; ++r)
+    out[r] = std::fabs(x[r]);
+}
+
+void batchExp(const double *const *columns, std::uint32_t, double *out, size_t rows) {
+  const double *x = columns[0];
+  for (size_t r = 0; r < rows; ++r)
+    out[r] = std::exp(x[r]);
+}
+
+void batchLog(const double *const *columns, std::uint32_t, double *out, size_t rows) {
+  const double *x = columns[0];
+  bool nonPositive = false;
+  for (size_t r = 0; r < rows; ++r)
+    nonPositive |= x[r] <= 0.0;
+  if (nonPositive) {
+    throw std::runtime_error("Logarithm of a non-positive number");
+  }
+  for (size_t r = 0; r < rows; ++r)
+    out[r] = std::log(x[r]);
+}
+
+void batchMin(const double *const *columns, std::uint32_t count, double *out, size_t rows) {
+  if (out != columns[0]) // The evaluators reuse the first operand's column.
+    std::copy(columns[0], columns[0] + rows, out);
+  for (std::uint32_t c = 1; c < count; ++c) {
+    const double *x = columns[c];
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = x[r] < out[r] ? x[r] : out[r];
+  }
+}
+
+void batchMax(const double *const *columns, std::uint32_t count, double *out, size_t rows) {
+  if (out != columns[0]) // The evaluators reuse the first operand's column.
+    std::copy(columns[0], columns[0] + rows, out);
+  for (std::uint32_t c = 1; c < count; ++c) {
+    const double *x = columns[c];
+    for (size_t r = 0; r < rows; ++r)
+      out[r] = x[r] > out[r] ? x[r] : out[r];
+  }
+}
+
+constexpr std::uint32_t anyCount = std::numeric_limits<std::uint32_t>::max();
+
+const MathFunction mathFunctions[] = {
+    {"sqrt", 1, 1, callSqrt, batchSqrt}, {"abs", 1, 1, callAbs, batchAbs},
+    {"exp", 1, 1, callExp, batchExp},    {"log", 1, 1, callLog, batchLog},
+    {"min", 1, anyCount, callMin, batchMin},
+    {"max", 1, anyCount, callMax, batchMax}};
+} // namespace
+
+const MathFunction *findFunction(std::string_view name) {
+  for (const MathFunction &function : mathFunctions) {
+    if (function.name == name)
+      return &function;
+  }
+  return nullptr;
+}
+
+// Lowest binds loosest: a || b && c < d + e * f ** g
+std::map<std::string, int, std::less<>> OperatorsHandling::operatorsPriority = {
+    {"||", 1}, {"&&", 2},
+    {"==", 3}, {"!=", 3},
+    {"<", 4}, {"<=", 4}, {">", 4}, {">=", 4},
+    {"+", 5}, {"-", 5}, {"*", 6}, {"/", 6}, {"^", 7}, {"**", 7}};
+
+std::map<std::string, OperatorKind, std::less<>> OperatorsHandling::operatorsKind = {
+    {"+", OperatorKind::Add}, {"-", OperatorKind::Subtract},
+    {"*", OperatorKind::Multiply}, {"/", OperatorKind::Divide},
+    {"^", OperatorKind::Power}, {"**", OperatorKind::Power},
+    {"<", OperatorKind::Less}, {"<=", OperatorKind::LessEqual},
+    {">", OperatorKind::Greater}, {">=", OperatorKind::GreaterEqual},
+    {"==", OperatorKind::Equal}, {"!=", OperatorKind::NotEqual},
+    {"&&", OperatorKind::And}, {"||", OperatorKind::Or},
+    {"if", OperatorKind::Conditional}};
+
+Token Token::number(double value) {
+  Token tok;
+  tok.type = Number;
+  tok.value = value;
+  return tok;
+}
+
+Token Token::cell(std::uint32_t slot, std::string_view name) {
+  Token tok;
+  tok.type = Cell;
+  tok.slot = slot;
+  tok.text = name;
+  return tok;
+}
+
+Token Token::op(OperatorKind kind) {
+  Token tok;
+  tok.type = Operator;
+  tok.kind = kind;
+  return tok;
+}
+
+Token Token::conditional() {
+  Token tok;
+  tok.type = Conditional;
+  tok.kind = OperatorKind::Conditional;
+  return tok;
+}
+
+Token Token::call(const MathFunction *function, std::uint32_t arity) {
+  Token tok;
+  tok.type = Call;
+  tok.function = function;
+  tok.arity = arity;
+  return tok;
+}
+
+Token Token::openParen() {
+  Token tok;
+  tok.type = OpenParen;
+  return tok;
+}
+
+Token Token::closeParen() {
+  Token tok;
+  tok.type = CloseParen;
+  return tok;
+}
+
+Token Token::comma() {
+  Token tok;
+  tok.type = Comma;
+  return tok;
+}
+
+std::string Token::toString() const {
+  switch (type) {
+  case Number:
+    return text.empty() ? formatNumber(value) : std::string(text);
+  case Cell:
+    return text.empty() ? "$" + std::to_string(slot) : std::string(text);
+  case Operator:
+    return text.empty() ? OperatorsHandling::getOperatorSymbol(kind) : std::string(text);
+  case Conditional:
+    return "if";
+  case Call:
+    if (!function)
+      break;
+    return function->name + "@" + std::to_string(arity);
+  case OpenParen:
+    return "(";
+  case CloseParen:
+    return ")";
+  case Comma:
+    return ",";
+  case Unknown:
+    break;
+  }
+  return std::string(text);
+}
+
+namespace {
+// Budget of the outermost limited call running on this thread. Inner calls
+// charge the same budget, so a request is limited as a whole.
+class Budget {
+public:
+  explicit Budget(const ExpressionLimits &limits) : limits(limits) {
+    if (limits.maxTime.count() > 0)
+      deadline = std::chrono::steady_clock::now() + limits.maxTime;
+  }
+
+  void checkInput(size_t bytes) const {
+    if (limits.maxInputBytes && bytes > limits.maxInputBytes) {
+      throw LimitExceeded("Input too large: " + std::to_string(bytes) + " bytes, the limit is " +
+                          std::to_string(limits.maxInputBytes) + ".");
+    }
+  }
+  void checkTokens(size_t count) const {
+    if (limits.maxTokens && count > limits.maxTokens) {
+      throw LimitExceeded("Too many tokens: the limit is " + std::to_string(limits.maxTokens) + ".");
+    }
+  }
+  void checkDepth(size_t depth) const {
+    if (limits.maxDepth && depth > limits.maxDepth) {
+      throw LimitExceeded("Expression nested too deeply: the limit is " +
+                          std::to_string(limits.maxDepth) + " levels.");
+    }
+  }
+  void checkOutput(size_t bytes) const {
+    if (limits.maxOutputBytes && bytes > limits.maxOutputBytes) {
+      throw LimitExceeded("Output too large: " + std::to_string(bytes) + " bytes, the limit is " +
+                          std::to_string(limits.maxOutputBytes) + ".");
+    }
+  }
+  // Records work about to be done, so an over-budget call fails before
+  // doing it. The clock is read at most once per 4096 steps.
+  void charge(size_t steps) {
+    used += steps;
+    if (limits.maxSteps && used > limits.maxSteps) {
+      throw LimitExceeded("Work budget exceeded: the limit is " + std::to_string(limits.maxSteps) + " steps.");
+    }
+    if (deadline && used >= nextClockCheck) {
+      nextClockCheck = used + 4096;
+      if (std::chrono::steady_clock::now() > *deadline) {
+        throw LimitExceeded("Time budget exceeded: the limit is " +
+                            std::to_string(limits.maxTime.count()) + " microseconds.");
       }
-      ops.pop(); // Pop the "("
-    } else {
-      throw std::runtime_error("Invalid infix expression: Unknown token '" + tok + "'.");
     }
   }
 
-  while (!ops.empty()) {
-    if (ops.top() == "(") {
-      throw std::runtime_error("Invalid infix expression: Mismatched parentheses - unclosed '('.");
+private:
+  const ExpressionLimits &limits;
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+  size_t used = 0;
+  size_t nextClockCheck = 0;
+};
+
+thread_local Budget *budget = nullptr;
+
+// Installs a budget for the call unless an outer call already has one.
+class BudgetScope {
+public:
+  explicit BudgetScope(const ExpressionLimits &limits) {
+    if (!budget && !limits.unlimited()) {
+      own.emplace(limits);
+      budget = &*own;
     }
-    output.push_back(ops.top());
-    ops.pop();
   }
-  return join(output);
+  ~BudgetScope() {
+    if (own)
+      budget = nullptr;
+  }
+  BudgetScope(const BudgetScope &) = delete;
+  BudgetScope &operator=(const BudgetScope &) = delete;
+
+private:
+  std::optional<Budget> own;
+};
+
+// Checks a token array handed in by the caller and charges reading it.
+void chargeTokens(size_t count) {
+  if (budget) {
+    budget->checkTokens(count);
+    budget->charge(count);
+  }
 }
 
-std::string ExpressionConverter::infixToPrefix(const std::string &expr) const {
-  auto tokens = tokenize(expr);
-  std::reverse(tokens.begin(), tokens.end());
+void chargeSteps(size_t steps) {
+  if (budget)
+    budget->charge(steps);
+}
+
+void checkDepth(size_t depth) {
+  if (budget)
+    budget->checkDepth(depth);
+}
 
-  // Swap parentheses
-  for (auto &tok : tokens) {
-    if (tok == "(") {
-      tok = ")";
-    } else if (tok == ")") {
-      tok = "(";
+void checkOutput(TokenSpan tokens) {
+  if (budget)
+    budget->checkOutput(ExpressionParser::joinedLength(tokens));
+}
+
+// Charges the program's instructions before running it.
+double runCharged(const ExpressionProgram &program, const double *slots = nullptr) {
+  chargeSteps(program.instructions().size());
+  return program.run(slots);
+}
+
+enum LexFlags {
+  ParenCalls = 1,   // A name followed by "(" is a call (infix).
+  TaggedCalls = 2,  // "max@3" is a call (postfix and prefix).
+  ParseNumbers = 4, // Convert literals; throw if one does not fit a double.
+};
+
+// Classifies one token and appends it; the token keeps 'text' as its view.
+void appendToken(std::vector<Token> &tokens, std::string_view text, int flags) {
+  static const OperatorsHandling operators;
+  Token tok;
+  tok.text = text;
+  unsigned char first = text.empty() ? 0 : static_cast<unsigned char>(text[0]);
+  if (std::isdigit(first) || first == '.') {
+    if (isNum(text)) {
+      tok.type = Token::Number;
+      if (flags & ParseNumbers)
+        tok.value = parseNumber(text);
+    }
+  } else if (std::isalpha(first) || first == '_') {
+    if (text == "if") {
+      tok.type = Token::Conditional;
+      tok.kind = OperatorKind::Conditional;
+    } else if (isIdentifier(text)) {
+      tok.type = Token::Cell;
+    } else if ((flags & TaggedCalls) && (tok.function = resolveCall(text, tok.arity))) {
+      tok.type = Token::Call;
     }
+  } else if (text.size() == 1 && first == '(') {
+    tok.type = Token::OpenParen;
+    if ((flags & ParenCalls) && !tokens.empty() && tokens.back().type == Token::Cell) {
+      tokens.back().type = Token::Call;
+      tokens.back().function = findFunction(tokens.back().text);
+    }
+  } else if (text.size() == 1 && first == ')') {
+    tok.type = Token::CloseParen;
+  } else if (text.size() == 1 && first == ',') {
+    tok.type = Token::Comma;
+  } else if (OperatorKind kind = operators.getOperatorKind(text); kind != OperatorKind::None) {
+    tok.type = Token::Operator;
+    tok.kind = kind;
   }
+  tokens.push_back(tok);
+}
 
-  std::vector<std::string> output;
-  std::stack<std::string> ops;
+std::vector<Token> lexTokens(const std::string &expr, int flags) {
+  std::vector<Token> tokens;
+  size_t count = 0;
+  if (budget) {
+    budget->checkInput(expr.size());
+    scan(expr, [&count](size_t, size_t) {
+      if (++count % 4096 == 0) {
+        budget->checkTokens(count);
+        budget->charge(4096);
+      }
+    });
+    budget->checkTokens(count);
+    budget->charge(count % 4096);
+  } else {
+    scan(expr, [&count](size_t, size_t) { ++count; });
+  }
+  tokens.reserve(count);
+  std::string_view source(expr);
+  scan(expr, [&](size_t begin, size_t length) {
+    appendToken(tokens, source.substr(begin, length), flags);
+  });
+  return tokens;
+}
+
+// Typed view of string tokens; the views point into 'tokens'.
+std::vector<Token> classifyTokens(const std::vector<std::string> &tokens, int flags) {
+  std::vector<Token> typed;
+  typed.reserve(tokens.size());
+  for (const auto &tok : tokens)
+    appendToken(typed, tok, flags);
+  return typed;
+}
+
+std::vector<std::string> tokenStrings(const std::vector<Token> &tokens) {
+  std::vector<std::string> strings;
+  strings.reserve(tokens.size());
+  for (const Token &tok : tokens)
+    strings.push_back(tok.toString());
+  return strings;
+}
+
+// Operands taken by a token, or -1 if it cannot appear in postfix/prefix.
+int arityOf(const Token &tok) {
+  switch (tok.type) {
+  case Token::Number:
+  case Token::Cell:
+    return 0;
+  case Token::Operator:
+    return tok.kind == OperatorKind::None || tok.kind == OperatorKind::Conditional ? -1 : 2;
+  case Token::Conditional:
+    return 3;
+  case Token::Call:
+    if (tok.function && tok.arity >= tok.function->minArgs && tok.arity <= tok.function->maxArgs)
+      return static_cast<int>(tok.arity);
+    return -1;
+  default:
+    return -1;
+  }
+}
+
+// Name of a call or 'if' as written in infix.
+std::string callName(const Token &tok) {
+  if (tok.type == Token::Conditional)
+    return "if";
+  return tok.function ? tok.function->name : std::string(tok.text);
+}
+} // namespace
+
+std::vector<Token> ExpressionParser::lex(const std::string &expr) {
+  auto tokens = lexTokens(expr, ParenCalls | TaggedCalls | ParseNumbers);
+  for (const Token &tok : tokens) {
+    if (tok.type == Token::Unknown) {
+      throw std::runtime_error("Unknown token '" + std::string(tok.text) + "'.");
+    }
+  }
+  return tokens;
+}
+
+size_t ExpressionParser::lexRange(const std::string &expr, size_t begin, size_t end, std::vector<Token> &out) {
+  size_t count = 0;
+  scan(expr, begin, end, [&count](size_t, size_t) { ++count; });
+  out.reserve(out.size() + count);
+  std::string_view source(expr);
+  return scan(expr, begin, end, [&](size_t first, size_t length) {
+    appendToken(out, source.substr(first, length), ParenCalls | TaggedCalls | ParseNumbers);
+  });
+}
+
+std::string_view ExpressionParser::spelling(TokenSpan tokens, size_t i, std::string &scratch) {
+  const Token &tok = tokens[i];
+  switch (tok.type) {
+  case Token::Call:
+    if (tok.function && i + 1 < tokens.size() && tokens[i + 1].type == Token::OpenParen)
+      return tok.function->name;
+    break;
+  case Token::Operator:
+    return tok.text.empty() ? std::string_view(OperatorsHandling::getOperatorSymbol(tok.kind)) : tok.text;
+  case Token::Conditional:
+    return "if";
+  case Token::OpenParen:
+    return "(";
+  case Token::CloseParen:
+    return ")";
+  case Token::Comma:
+    return ",";
+  default:
+    if (!tok.text.empty())
+      return tok.text;
+    break;
+  }
+  scratch = tok.toString();
+  return scratch;
+}
+
+size_t ExpressionParser::joinedLength(TokenSpan tokens) {
+  std::string scratch;
+  size_t length = tokens.empty() ? 0 : tokens.size() - 1;
+  for (size_t i = 0; i < tokens.size(); ++i)
+    length += spelling(tokens, i, scratch).size();
+  return length;
+}
+
+std::string ExpressionParser::join(TokenSpan tokens) {
+  std::string out;
+  out.reserve(joinedLength(tokens));
+  joinTo(tokens, std::back_inserter(out));
+  return out;
+}
+
+std::vector<Token> ExpressionParser::infixToPostfixTokens(TokenSpan tokens) const {
+  return shuntingYard(tokens, false);
+}
 
-  // This is essentially infix-to-postfix shunting yard on the reversed/parenthesis-swapped string
-  for (const auto &tok : tokens) {
-    if (isNum(tok)) {
+std::vector<Token> ExpressionParser::shuntingYard(TokenSpan tokens, bool forPrefix) const {
+  BudgetScope scope(limits);
+  chargeTokens(tokens.size());
+  // infixToPrefix has always named itself in these errors; it read the
+  // expression reversed, so its parenthesis messages are swapped.
+  const std::string invalid = forPrefix ? "Invalid infix expression (for prefix conversion): "
+                                        : "Invalid infix expression: ";
+  const char *noMatchingOpen = forPrefix ? "Mismatched parentheses - unclosed '('. Original ')' was unclosed."
+                                         : "Mismatched parentheses - no matching '('.";
+  const char *unclosedOpen = forPrefix ? "Mismatched parentheses - no matching '('. Original ')' was missing."
+                                       : "Mismatched parentheses - unclosed '('.";
+  std::vector<Token> output;
+  output.reserve(tokens.size());
+  std::vector<Token> ops;
+  // One entry per open parenthesis: whether it opens the argument list of
+  // 'if' or a call, and how many arguments have been started inside it.
+  std::vector<std::pair<bool, std::uint32_t>> parens;
+  // Whether an operand was read since the last "(" or ",".
+  bool operand = false;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    const Token &tok = tokens[i];
+    switch (tok.type) {
+    case Token::Number:
+    case Token::Cell:
       output.push_back(tok);
-    } else if (opHandling.isOperator(tok)) {
-      // For prefix (reversed infix processed as postfix), operator associativity rules are flipped for comparison.
-      // Left-associative in infix (like *, /) become right-associative when reversed.
-      // Right-associative in infix (like ^, **) become left-associative when reversed.
-      // Standard postfix rule: pop if stack_op_prec >= current_op_prec (for left-assoc)
-      // or stack_op_prec > current_op_prec (for right-assoc)
-
-      // Let's consider the original associativity of the operator `tok`
-      bool tok_is_originally_right_associative = (tok == "^" || tok == "**");
-
-      while (!ops.empty() && ops.top() != "(" && opHandling.isOperator(ops.top())) {
-        int prec_tok = opHandling.getOperatorPriority(tok);
-        int prec_stack = opHandling.getOperatorPriority(ops.top());
-
-        // If tok was originally right-associative (e.g. ^), when reversed, it behaves like a left-associative rule for popping.
-        // Pop if stack operator has greater or equal precedence.
-        // If tok was originally left-associative (e.g. *), when reversed, it behaves like a right-associative rule for popping.
-        // Pop if stack operator has strictly greater precedence.
-        if ((tok_is_originally_right_associative && prec_stack >= prec_tok) ||
-            (!tok_is_originally_right_associative && prec_stack > prec_tok)) {
-          output.push_back(ops.top());
-          ops.pop();
+      operand = true;
+      break;
+    case Token::Operator: {
+      int precedence = opHandling.getOperatorPriority(tok.kind);
+      if (precedence < 0) {
+        throw std::runtime_error(invalid + "Unknown token '" + tok.toString() + "'.");
+      }
+      // '**' is right-associative, all others left.
+      bool rightAssociative = tok.kind == OperatorKind::Power;
+      while (!ops.empty() && ops.back().type == Token::Operator) {
+        int stacked = opHandling.getOperatorPriority(ops.back().kind);
+        if (rightAssociative ? stacked > precedence : stacked >= precedence) {
+          output.push_back(ops.back());
+          ops.pop_back();
         } else {
           break;
         }
       }
-      ops.push(tok);
-    } else if (tok == "(") { // This is a ')' from original expression
-      ops.push(tok);
-    } else if (tok == ")") { // This is a '(' from original expression
-      while (!ops.empty() && ops.top() != "(") {
-        output.push_back(ops.top());
-        ops.pop();
+      ops.push_back(tok);
+      checkDepth(ops.size());
+      break;
+    }
+    case Token::Conditional:
+    case Token::Call:
+      if (tok.type == Token::Call && !tok.function) {
+        throw std::runtime_error("Invalid infix expression: Unknown function '" + callName(tok) + "'.");
+      }
+      if (i + 1 >= tokens.size() || tokens[i + 1].type != Token::OpenParen) {
+        throw std::runtime_error("Invalid infix expression: Expected '(' after '" + callName(tok) + "'.");
+      }
+      ops.push_back(tok);
+      ops.push_back(tokens[i + 1]);
+      parens.emplace_back(true, i + 2 < tokens.size() && tokens[i + 2].type == Token::CloseParen ? 0 : 1);
+      checkDepth(ops.size());
+      ++i; // The "(" has been consumed.
+      operand = false;
+      break;
+    case Token::OpenParen:
+      ops.push_back(tok);
+      parens.emplace_back(false, 0);
+      checkDepth(ops.size());
+      operand = false;
+      break;
+    case Token::Comma:
+      while (!ops.empty() && ops.back().type != Token::OpenParen) {
+        output.push_back(ops.back());
+        ops.pop_back();
+      }
+      if (parens.empty() || !parens.back().first) {
+        throw std::runtime_error("Invalid infix expression: ',' outside of an argument list.");
+      }
+      if (!operand) {
+        throw std::runtime_error("Invalid infix expression: empty argument");
+      }
+      ++parens.back().second;
+      operand = false;
+      break;
+    case Token::CloseParen: {
+      while (!ops.empty() && ops.back().type != Token::OpenParen) {
+        output.push_back(ops.back());
+        ops.pop_back();
       }
       if (ops.empty()) {
-        throw std::runtime_error("Invalid infix expression (for prefix conversion): Mismatched parentheses - no matching '('. Original ')' was missing.");
+        throw std::runtime_error(invalid + noMatchingOpen);
       }
-      ops.pop(); // Pop the corresponding "("
-    } else {
-      throw std::runtime_error("Invalid infix expression (for prefix conversion): Unknown token '" + tok + "'.");
+      ops.pop_back(); // Pop the "("
+      auto paren = parens.back();
+      parens.pop_back();
+      if (paren.first && paren.second > 0 && !operand) {
+        throw std::runtime_error("Invalid infix expression: empty argument");
+      }
+      operand = true;
+      if (!paren.first)
+        break;
+      Token head = ops.back();
+      ops.pop_back();
+      std::uint32_t count = paren.second;
+      if (head.type == Token::Conditional) {
+        if (count != 3) {
+          throw std::runtime_error("Invalid infix expression: 'if' expects 3 arguments.");
+        }
+      } else {
+        const MathFunction *function = head.function;
+        if (count < function->minArgs || count > function->maxArgs) {
+          std::string expected = function->minArgs == function->maxArgs
+                                     ? std::to_string(function->minArgs)
+                                     : "at least " + std::to_string(function->minArgs);
+          throw std::runtime_error("Invalid infix expression: '" + function->name + "' expects " + expected +
+                                   (function->minArgs == 1 ? " argument." : " arguments."));
+        }
+        head.arity = count;
+      }
+      output.push_back(head);
+      break;
+    }
+    default:
+      throw std::runtime_error(invalid + "Unknown token '" + tok.toString() + "'.");
     }
   }
 
   while (!ops.empty()) {
-    if (ops.top() == "(") { // This means an original ')' was left unclosed
-      throw std::runtime_error("Invalid infix expression (for prefix conversion): Mismatched parentheses - unclosed '('. Original ')' was unclosed.");
+    if (ops.back().type == Token::OpenParen) {
+      throw std::runtime_error(invalid + unclosedOpen);
     }
-    output.push_back(ops.top());
-    ops.pop();
+    output.push_back(ops.back());
+    ops.pop_back();
   }
+  return output;
+}
 
-  std::reverse(output.begin(), output.end()); // Reverse the postfix to get prefix
-  return join(output);
+std::vector<std::string>
+ExpressionParser::infixToPostfixTokens(const std::vector<std::string> &tokens) const {
+  return tokenStrings(infixToPostfixTokens(classifyTokens(tokens, ParenCalls)));
 }
 
-std::string
-ExpressionConverter::postfixToPrefix(const std::string &expr) const {
-  auto tokens = tokenize(expr);
-  std::stack<std::string> st; // Changed to stack<string>
-  for (const auto &tok : tokens) { // Iterate left to right
-    if (isNum(tok)) {
-      st.push(tok);
-    } else if (opHandling.isOperator(tok)) {
-      if (st.size() < 2) {
-        throw std::runtime_error("Invalid postfix expression: insufficient operands for operator " + tok);
-      }
-      std::string operand2 = st.top(); // op2 is top for postfix
-      st.pop();
-      std::string operand1 = st.top(); // op1 is second for postfix
-      st.pop();
-      // For postfix to prefix: operator operand1 operand2
-      st.push(tok + " " + operand1 + " " + operand2);
-    } else {
-      throw std::runtime_error("Invalid token in postfix expression: " + tok);
+// How a sequence that leaves more than one item is reported: the postfix and
+// prefix reorderings have always worded it one way, the conversions to
+// infix and the evaluators the other.
+static const char *const reorderLeftover = "stack should have one item at the end.";
+static const char *const finalStackLeftover = "The final stack should contain exactly one item.";
+
+// For every token of a postfix sequence, the index where the subexpression
+// ending at that token starts. Validates the sequence on the way.
+static std::vector<size_t> subexpressionStarts(TokenSpan tokens, const std::string &notation,
+                                               const char *leftover = finalStackLeftover) {
+  chargeTokens(tokens.size());
+  std::vector<size_t> start(tokens.size());
+  std::vector<size_t> st;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    int arity = arityOf(tokens[i]);
+    if (arity < 0) {
+      throw std::runtime_error("Invalid token in " + notation + " expression: " + tokens[i].toString());
+    }
+    if (st.size() < static_cast<size_t>(arity)) {
+      throw std::runtime_error("Invalid " + notation + " expression: insufficient operands for operator " + tokens[i].toString());
     }
+    start[i] = i;
+    if (arity > 0) {
+      start[i] = st[st.size() - arity];
+      st.resize(st.size() - arity);
+    }
+    st.push_back(start[i]);
+    checkDepth(st.size());
   }
   if (st.size() != 1) {
-    throw std::runtime_error("Invalid postfix expression: stack should have one item at the end.");
+    throw std::runtime_error("Invalid " + notation + " expression: " + leftover);
   }
-  return st.top();
+  return start;
 }
 
-std::string
-ExpressionConverter::prefixToPostfix(const std::string &expr) const {
-  auto tokens = tokenize(expr);
-  std::stack<std::string> st; // Changed to stack<string>
-  for (int i = static_cast<int>(tokens.size()) - 1; i >= 0; --i) { // Iterate right to left
-    const auto &tok = tokens[i];
-    if (isNum(tok)) {
-      st.push(tok);
-    } else if (opHandling.isOperator(tok)) {
-      if (st.size() < 2) {
-        throw std::runtime_error("Invalid prefix expression: insufficient operands for operator " + tok);
-      }
-      // For prefix to postfix, when reading tokens from right to left:
-      // Top of stack is operand1 (left operand in infix/postfix)
-      // Second top is operand2 (right operand in infix/postfix)
-      std::string operand1 = st.top();
-      st.pop();
-      std::string operand2 = st.top();
-      st.pop();
-      // For prefix to postfix: operand1 operand2 operator
-      st.push(operand1 + " " + operand2 + " " + tok);
-    } else {
-      throw std::runtime_error("Invalid token in prefix expression: " + tok);
+// Postfix tokens in prefix order, given their subexpression starts.
+static std::vector<Token> prefixOrder(TokenSpan tokens, const std::vector<size_t> &start) {
+  std::vector<Token> output;
+  output.reserve(tokens.size());
+  // Pre-order walk. A subexpression is identified by its last token, which
+  // is its operator; its operands end right before it, back to back.
+  std::vector<size_t> pending{tokens.size() - 1};
+  std::vector<size_t> operands;
+  while (!pending.empty()) {
+    size_t i = pending.back();
+    pending.pop_back();
+    output.push_back(tokens[i]);
+    operands.clear();
+    for (size_t end = i; end > start[i]; end = start[end - 1]) {
+      operands.push_back(end - 1); // Collected last operand first.
     }
+    pending.insert(pending.end(), operands.begin(), operands.end());
   }
-  if (st.size() != 1) {
-    throw std::runtime_error("Invalid prefix expression: stack should have one item at the end.");
+  return output;
+}
+
+std::vector<Token> ExpressionParser::postfixToPrefixTokens(TokenSpan tokens,
+                                                           const std::string &notation) const {
+  BudgetScope scope(limits);
+  return prefixOrder(tokens, subexpressionStarts(tokens, notation, reorderLeftover));
+}
+
+std::vector<std::string>
+ExpressionParser::postfixToPrefixTokens(const std::vector<std::string> &tokens,
+                                        const std::string &notation) const {
+  return tokenStrings(postfixToPrefixTokens(classifyTokens(tokens, TaggedCalls), notation));
+}
+
+// Prefix tokens in postfix order. Validates the sequence on the way.
+static std::vector<Token> postfixOrder(TokenSpan tokens, const std::string &notation,
+                                       const char *leftover = finalStackLeftover) {
+  chargeTokens(tokens.size());
+  std::vector<Token> output;
+  output.reserve(tokens.size());
+  // Operators still waiting for operands: (token index, operands missing).
+  std::vector<std::pair<size_t, int>> open;
+  bool complete = false;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    int arity = arityOf(tokens[i]);
+    if (arity < 0) {
+      throw std::runtime_error("Invalid token in " + notation + " expression: " + tokens[i].toString());
+    }
+    if (complete) {
+      throw std::runtime_error("Invalid " + notation + " expression: " + leftover);
+    }
+    if (arity > 0) {
+      open.emplace_back(i, arity);
+      checkDepth(open.size());
+      continue;
+    }
+    output.push_back(tokens[i]);
+    // An operand may complete a chain of operators.
+    while (!open.empty() && --open.back().second == 0) {
+      output.push_back(tokens[open.back().first]);
+      open.pop_back();
+    }
+    complete = open.empty();
+  }
+  if (!open.empty()) {
+    throw std::runtime_error("Invalid " + notation + " expression: insufficient operands for operator " + tokens[open.back().first].toString());
   }
-  return st.top();
+  if (!complete) {
+    throw std::runtime_error("Invalid " + notation + " expression: " + leftover);
+  }
+  return output;
 }
 
-std::string ExpressionConverter::postfixToInfix(const std::string &expr) const {
-  auto tokens = tokenize(expr);
-  std::stack<std::string> st; // Stack now holds strings directly
-  for (const auto &tok : tokens) {
-    if (isNum(tok)) {
-      st.push(tok);
-    } else if (opHandling.isOperator(tok)) { // Use opHandling to check for operator
-      if (st.size() < 2) {
-        throw std::runtime_error("Invalid postfix expression: insufficient operands for operator " + tok);
-      }
-      std::string operand2 = st.top();
-      st.pop();
-      std::string operand1 = st.top();
-      st.pop();
-      // Form the infix sub-expression: "( operand1 op operand2 )" with spaces
-      st.push("( " + operand1 + " " + tok + " " + operand2 + " )");
+std::vector<Token> ExpressionParser::prefixToPostfixTokens(TokenSpan tokens,
+                                                           const std::string &notation) const {
+  BudgetScope scope(limits);
+  return postfixOrder(tokens, notation, reorderLeftover);
+}
+
+std::vector<std::string>
+ExpressionParser::prefixToPostfixTokens(const std::vector<std::string> &tokens,
+                                        const std::string &notation) const {
+  return tokenStrings(prefixToPostfixTokens(classifyTokens(tokens, TaggedCalls), notation));
+}
+
+// Canonical infix of postfix tokens, given their subexpression starts.
+static std::vector<Token> canonicalInfix(TokenSpan tokens, const std::vector<size_t> &start) {
+  static const Token open = Token::openParen(), close = Token::closeParen(), comma = Token::comma();
+  std::vector<Token> output;
+  output.reserve(tokens.size() * 2);
+  // Entries with 'expand' set are subexpressions, identified by their last
+  // token; the others are written as they are.
+  std::vector<std::pair<const Token *, bool>> st{{&tokens[tokens.size() - 1], true}};
+  std::vector<size_t> operands;
+  while (!st.empty()) {
+    auto [tok, expand] = st.back();
+    st.pop_back();
+    if (!expand || arityOf(*tok) == 0) {
+      output.push_back(*tok);
+      continue;
+    }
+    size_t i = static_cast<size_t>(tok - tokens.begin());
+    operands.clear();
+    for (size_t end = i; end > start[i]; end = start[end - 1]) {
+      operands.push_back(end - 1); // Collected last operand first.
+    }
+    if (tok->type == Token::Operator) {
+      // "( left op right )"
+      output.push_back(open);
+      st.push_back({&close, false});
+      st.push_back({&tokens[operands[0]], true});
+      st.push_back({tok, false});
+      st.push_back({&tokens[operands[1]], true});
     } else {
-      // This case should ideally not be reached if the postfix expression is valid
-      // and only contains numbers and recognized operators.
-      throw std::runtime_error("Invalid token in postfix expression: " + tok);
+      // 'if' or a function call: "name ( a , b , ... )".
+      output.push_back(*tok);
+      output.push_back(open);
+      st.push_back({&close, false});
+      for (size_t k = 0; k < operands.size(); ++k) {
+        if (k > 0)
+          st.push_back({&comma, false});
+        st.push_back({&tokens[operands[k]], true});
+      }
     }
   }
-  if (st.size() != 1) {
-    throw std::runtime_error("Invalid postfix expression: The final stack should contain exactly one item.");
+  return output;
+}
+
+std::vector<Token> ExpressionParser::postfixToInfixTokens(TokenSpan tokens,
+                                                          const std::string &notation) const {
+  BudgetScope scope(limits);
+  return canonicalInfix(tokens, subexpressionStarts(tokens, notation));
+}
+
+std::vector<Token> ExpressionConverter::convert(Conversion conversion, const std::string &expr) const {
+  BudgetScope scope(limits);
+  std::vector<Token> result = convertTokens(conversion, expr);
+  checkOutput(result);
+  return result;
+}
+
+std::vector<Token> ExpressionConverter::convertTokens(Conversion conversion, const std::string &expr) const {
+  switch (conversion) {
+  case Conversion::InfixToPrefix:
+    return postfixToPrefixTokens(shuntingYard(lexTokens(expr, ParenCalls), true), "infix");
+  case Conversion::PostfixToPrefix:
+    return postfixToPrefixTokens(lexTokens(expr, TaggedCalls), "postfix");
+  case Conversion::InfixToPostfix:
+    return infixToPostfixTokens(lexTokens(expr, ParenCalls));
+  case Conversion::PrefixToPostfix:
+    return prefixToPostfixTokens(lexTokens(expr, TaggedCalls), "prefix");
+  case Conversion::PrefixToInfix:
+    return postfixToInfixTokens(postfixOrder(lexTokens(expr, TaggedCalls), "prefix"), "prefix");
+  case Conversion::PostfixToInfix:
+    return postfixToInfixTokens(lexTokens(expr, TaggedCalls), "postfix");
   }
-  return st.top();
+  throw std::runtime_error("Unknown conversion");
 }
 
-std::string ExpressionConverter::prefixToInfix(const std::string &expr) const {
-  auto tokens = tokenize(expr);
-  std::stack<std::string> st; // Stack now holds strings directly
-  // Iterate from right to left for prefix to infix conversion
-  for (int i = static_cast<int>(tokens.size()) - 1; i >= 0; --i) {
-    const auto &tok = tokens[i];
-    if (isNum(tok)) {
-      st.push(tok);
-    } else if (opHandling.isOperator(tok)) { // Use opHandling to check for operator
-      if (st.size() < 2) {
-        throw std::runtime_error("Invalid prefix expression: insufficient operands for operator " + tok);
+namespace {
+void appendJoined(TokenSpan tokens, std::string &out) {
+  out.reserve(out.size() + ExpressionParser::joinedLength(tokens));
+  ExpressionParser::joinTo(tokens, std::back_inserter(out));
+}
+
+void assignJoined(TokenSpan tokens, std::string &out) {
+  checkOutput(tokens);
+  out.clear();
+  appendJoined(tokens, out);
+}
+
+size_t copyJoined(TokenSpan tokens, char *buffer, size_t size) {
+  size_t length = ExpressionParser::joinedLength(tokens);
+  if (length <= size)
+    ExpressionParser::joinTo(tokens, buffer);
+  return length;
+}
+} // namespace
+
+ExpressionConverter::Forms ExpressionConverter::convertAll(const std::string &notation, const std::string &expr,
+                                                          unsigned forms) const {
+  Forms out;
+  convertAll(notation, expr, forms, out);
+  return out;
+}
+
+void ExpressionConverter::convertAll(const std::string &notation, const std::string &expr, unsigned forms,
+                                     Forms &out) const {
+  BudgetScope scope(limits);
+  out.prefix.clear();
+  out.postfix.clear();
+  out.infix.clear();
+  out.value = 0.0;
+  out.error.clear();
+  // Literals are parsed only for the value, so that conversions accept
+  // what the single conversions accept.
+  std::vector<Token> postfix;
+  if (notation == "infix")
+    postfix = infixToPostfixTokens(lexTokens(expr, ParenCalls));
+  else if (notation == "prefix")
+    postfix = postfixOrder(lexTokens(expr, TaggedCalls), notation);
+  else if (notation == "postfix")
+    postfix = lexTokens(expr, TaggedCalls);
+  else
+    throw std::runtime_error("Invalid request: unknown notation '" + notation + "'.");
+
+  // The walk for prefix and infix is shared. Postfix input is only checked
+  // by it, as the postfix to postfix request checks it.
+  std::vector<size_t> start;
+  if ((forms & (PrefixForm | InfixForm)) || ((forms & PostfixForm) && notation == "postfix"))
+    start = subexpressionStarts(postfix, notation);
+  if (forms & PrefixForm)
+    assignJoined(prefixOrder(postfix, start), out.prefix);
+  if (forms & PostfixForm)
+    assignJoined(postfix, out.postfix);
+  if (forms & InfixForm)
+    assignJoined(canonicalInfix(postfix, start), out.infix);
+  if (forms & ValueForm) {
+    try {
+      for (Token &tok : postfix) {
+        if (tok.type == Token::Number)
+          tok.value = parseNumber(tok.text);
       }
-      // When processing prefix from right to left:
-      // The first operand popped (top of stack) is the one that was to the left of the operator.
-      // The second operand popped is the one that was to the right of the operator.
-      std::string operand1 = st.top();
-      st.pop();
-      std::string operand2 = st.top();
-      st.pop();
-      // Form the infix sub-expression: "( operand1 op operand2 )" with spaces
-      st.push("( " + operand1 + " " + tok + " " + operand2 + " )");
-    } else {
-      // This case should ideally not be reached if the prefix expression is valid.
-      throw std::runtime_error("Invalid token in prefix expression: " + tok);
+      out.value = runCharged(ExpressionProgram::compile(postfix, notation));
+    } catch (const LimitExceeded &) {
+      throw;
+    } catch (const std::runtime_error &e) {
+      out.value = std::numeric_limits<double>::quiet_NaN();
+      out.error = e.what();
     }
   }
-  if (st.size() != 1) {
-    throw std::runtime_error("Invalid prefix expression: The final stack should contain exactly one item.");
+}
+
+std::string ExpressionConverter::infixToPrefix(const std::string &expr) const {
+  return join(convert(Conversion::InfixToPrefix, expr));
+}
+
+std::string ExpressionConverter::postfixToPrefix(const std::string &expr) const {
+  return join(convert(Conversion::PostfixToPrefix, expr));
+}
+
+std::string ExpressionConverter::infixToPostfix(const std::string &expr) const {
+  return join(convert(Conversion::InfixToPostfix, expr));
+}
+
+std::string ExpressionConverter::prefixToPostfix(const std::string &expr) const {
+  return join(convert(Conversion::PrefixToPostfix, expr));
+}
+
+std::string ExpressionConverter::prefixToInfix(const std::string &expr) const {
+  return join(convert(Conversion::PrefixToInfix, expr));
+}
+
+std::string ExpressionConverter::postfixToInfix(const std::string &expr) const {
+  return join(convert(Conversion::PostfixToInfix, expr));
+}
+
+void ExpressionConverter::infixToPrefix(const std::string &expr, std::string &out) const {
+  appendJoined(convert(Conversion::InfixToPrefix, expr), out);
+}
+
+void ExpressionConverter::postfixToPrefix(const std::string &expr, std::string &out) const {
+  appendJoined(convert(Conversion::PostfixToPrefix, expr), out);
+}
+
+void ExpressionConverter::infixToPostfix(const std::string &expr, std::string &out) const {
+  appendJoined(convert(Conversion::InfixToPostfix, expr), out);
+}
+
+void ExpressionConverter::prefixToPostfix(const std::string &expr, std::string &out) const {
+  appendJoined(convert(Conversion::PrefixToPostfix, expr), out);
+}
+
+void ExpressionConverter::prefixToInfix(const std::string &expr, std::string &out) const {
+  appendJoined(convert(Conversion::PrefixToInfix, expr), out);
+}
+
+void ExpressionConverter::postfixToInfix(const std::string &expr, std::string &out) const {
+  appendJoined(convert(Conversion::PostfixToInfix, expr), out);
+}
+
+size_t ExpressionConverter::infixToPrefix(const std::string &expr, char *buffer, size_t size) const {
+  return copyJoined(convert(Conversion::InfixToPrefix, expr), buffer, size);
+}
+
+size_t ExpressionConverter::postfixToPrefix(const std::string &expr, char *buffer, size_t size) const {
+  return copyJoined(convert(Conversion::PostfixToPrefix, expr), buffer, size);
+}
+
+size_t ExpressionConverter::infixToPostfix(const std::string &expr, char *buffer, size_t size) const {
+  return copyJoined(convert(Conversion::InfixToPostfix, expr), buffer, size);
+}
+
+size_t ExpressionConverter::prefixToPostfix(const std::string &expr, char *buffer, size_t size) const {
+  return copyJoined(convert(Conversion::PrefixToPostfix, expr), buffer, size);
+}
+
+size_t ExpressionConverter::prefixToInfix(const std::string &expr, char *buffer, size_t size) const {
+  return copyJoined(convert(Conversion::PrefixToInfix, expr), buffer, size);
+}
+
+size_t ExpressionConverter::postfixToInfix(const std::string &expr, char *buffer, size_t size) const {
+  return copyJoined(convert(Conversion::PostfixToInfix, expr), buffer, size);
+}
+
+std::vector<Token> ExpressionConverter::infixToPrefix(TokenSpan tokens) const {
+  return postfixToPrefixTokens(infixToPostfixTokens(tokens), "infix");
+}
+
+std::vector<Token> ExpressionConverter::postfixToPrefix(TokenSpan tokens) const {
+  return postfixToPrefixTokens(tokens, "postfix");
+}
+
+std::vector<Token> ExpressionConverter::infixToPostfix(TokenSpan tokens) const {
+  return infixToPostfixTokens(tokens);
+}
+
+std::vector<Token> ExpressionConverter::prefixToPostfix(TokenSpan tokens) const {
+  return prefixToPostfixTokens(tokens, "prefix");
+}
+
+std::vector<Token> ExpressionConverter::prefixToInfix(TokenSpan tokens) const {
+  BudgetScope scope(limits);
+  return postfixToInfixTokens(postfixOrder(tokens, "prefix"), "prefix");
+}
+
+std::vector<Token> ExpressionConverter::postfixToInfix(TokenSpan tokens) const {
+  return postfixToInfixTokens(tokens, "postfix");
+}
+
+ExpressionProgram ExpressionProgram::compile(const std::vector<std::string> &postfix,
+                                             const std::string &notation,
+                                             const Resolver &resolve) {
+  std::vector<Token> tokens = classifyTokens(postfix, TaggedCalls | ParseNumbers);
+  ExpressionProgram program = compile(tokens, notation, resolve != nullptr);
+  // Loads were emitted in token order; bind each to its resolved slot.
+  auto cell = tokens.begin();
+  for (Instruction &in : program.code) {
+    if (in.code == Instruction::Load) {
+      cell = std::find_if(cell, tokens.end(), [](const Token &tok) { return tok.type == Token::Cell; });
+      in.operand = resolve(std::string((cell++)->text));
+    }
   }
-  return st.top();
+  return program;
 }
 
-double ExpressionEvaluator::calcPostfix(const std::string &expr) const {
-  auto tokens = tokenize(expr);
-  std::stack<double> st; // Changed stack type to double
-  for (const auto &tok : tokens) { // Use const auto&
-    if (isNum(tok)) {
-      try {
-        st.push(std::stod(tok)); // Convert to double
-      } catch (const std::out_of_range& oor) {
-        throw std::runtime_error("Number out of range for double: " + tok);
-      }
-    } else if (opHandling.isOperator(tok)) { // Use opHandling to check operator
-      if (st.size() < 2) {
-        throw std::runtime_error("Invalid postfix expression: insufficient operands for operator " + tok);
+ExpressionProgram ExpressionProgram::compile(TokenSpan postfix, const std::string &notation,
+                                             bool cellsBound) {
+  auto start = subexpressionStarts(postfix, notation);
+
+  // '&&', '||' and 'if' need a jump right before one of their operands:
+  // before the right operand of '&&'/'||', and before both branches of 'if'.
+  // Those positions are operand starts, known from 'start'.
+  enum Hook : std::uint8_t { None, AndRight, OrRight, IfThen, IfElse };
+  std::vector<std::pair<Hook, size_t>> hooks(postfix.size(), {None, 0});
+  for (size_t i = 0; i < postfix.size(); ++i) {
+    const Token &tok = postfix[i];
+    if (tok.type == Token::Operator && (tok.kind == OperatorKind::And || tok.kind == OperatorKind::Or)) {
+      hooks[start[i - 1]] = {tok.kind == OperatorKind::And ? AndRight : OrRight, i};
+    } else if (tok.type == Token::Conditional) {
+      size_t elseStart = start[i - 1];
+      size_t thenStart = start[elseStart - 1];
+      hooks[thenStart] = {IfThen, i};
+      hooks[elseStart] = {IfElse, i};
+    }
+  }
+
+  ExpressionProgram program;
+  auto &code = program.code;
+  code.reserve(postfix.size() + postfix.size() / 2);
+  // Jumps waiting for their target, keyed by the token that resolves them.
+  std::vector<std::uint32_t> patch(postfix.size()), patchElse(postfix.size());
+  size_t depth = 0;
+  for (size_t i = 0; i < postfix.size(); ++i) {
+    auto position = [&code] { return static_cast<std::uint32_t>(code.size()); };
+    switch (hooks[i].first) {
+    case AndRight:
+      patch[hooks[i].second] = position();
+      code.push_back({Instruction::JumpIfFalseOrPop, OperatorKind::None, 0, 0.0});
+      break;
+    case OrRight:
+      patch[hooks[i].second] = position();
+      code.push_back({Instruction::JumpIfTrueOrPop, OperatorKind::None, 0, 0.0});
+      break;
+    case IfThen:
+      patch[hooks[i].second] = position();
+      code.push_back({Instruction::JumpIfFalse, OperatorKind::None, 0, 0.0});
+      break;
+    case IfElse:
+      patchElse[hooks[i].second] = position();
+      code.push_back({Instruction::Jump, OperatorKind::None, 0, 0.0});
+      code[patch[hooks[i].second]].operand = position();
+      break;
+    case None:
+      break;
+    }
+
+    const Token &tok = postfix[i];
+    switch (tok.type) {
+    case Token::Number:
+      code.push_back({Instruction::Push, OperatorKind::None, 0, tok.value});
+      program.maxDepth = std::max(program.maxDepth, ++depth);
+      break;
+    case Token::Cell:
+      if (!cellsBound) {
+        throw std::runtime_error("Unbound cell reference '" + tok.toString() + "' in " + notation + " expression.");
       }
-      double b = st.top(); // Operands are double
-      st.pop();
-      double a = st.top();
-      st.pop();
-      if (tok == "+") {
-        st.push(a + b);
-      } else if (tok == "-") {
-        st.push(a - b);
-      } else if (tok == "*") {
-        st.push(a * b);
-      } else if (tok == "/") {
-        if (b == 0.0) {
-          throw std::runtime_error("Division by zero");
-        }
-        st.push(a / b); // Floating point division
-      } else if (tok == "^" || tok == "**") {
-        st.push(std::pow(a, b)); // Operates on and returns double
+      code.push_back({Instruction::Load, OperatorKind::None, tok.slot, 0.0});
+      program.maxDepth = std::max(program.maxDepth, ++depth);
+      break;
+    case Token::Call:
+      code.push_back({Instruction::Call, OperatorKind::None, tok.arity, 0.0, tok.function->call});
+      depth -= tok.arity - 1;
+      break;
+    case Token::Conditional:
+      code[patchElse[i]].operand = position();
+      depth -= 2;
+      break;
+    default: // Operators; subexpressionStarts rejected everything else.
+      if (tok.kind == OperatorKind::And || tok.kind == OperatorKind::Or) {
+        code.push_back({Instruction::ToBool, OperatorKind::None, 0, 0.0});
+        code[patch[i]].operand = position();
       } else {
-        // This part should ideally not be reached if opHandling.isOperator is comprehensive
-        throw std::runtime_error("Unknown operator in postfix expression: " + tok);
+        code.push_back({Instruction::Apply, tok.kind, 0, 0.0});
       }
-    } else {
-      throw std::runtime_error("Invalid token in postfix expression: " + tok);
+      --depth;
+      break;
     }
   }
-  if (st.size() != 1) {
-    throw std::runtime_error("Invalid postfix expression: The final stack should contain exactly one item.");
-  }
-  return st.top();
+  return program;
 }
 
-double ExpressionEvaluator::calcPrefix(const std::string &expr) const {
-  auto tokens = tokenize(expr);
-  std::stack<double> st; // Changed stack type to double
-  for (int i = static_cast<int>(tokens.size()) - 1; i >= 0; --i) {
-    const auto &tok = tokens[i];
-    if (isNum(tok)) {
-      try {
-        st.push(std::stod(tok)); // Convert to double
-      } catch (const std::out_of_range& oor) {
-        throw std::runtime_error("Number out of range for double: " + tok);
-      }
-    } else if (opHandling.isOperator(tok)) { // Use opHandling to check operator
-      if (st.size() < 2) {
-        throw std::runtime_error("Invalid prefix expression: insufficient operands for operator " + tok);
+double ExpressionProgram::run(const double *slots) const {
+  // Operand stack; maxDepth was worked out at compile time.
+  double small[64];
+  std::vector<double> large;
+  double *st = small;
+  if (maxDepth > 64) {
+    large.resize(maxDepth);
+    st = large.data();
+  }
+  size_t sp = 0;
+  for (size_t pc = 0; pc < code.size();) {
+    const Instruction &in = code[pc++];
+    switch (in.code) {
+    case Instruction::Push:
+      st[sp++] = in.value;
+      break;
+    case Instruction::Load:
+      st[sp++] = slots[in.operand];
+      break;
+    case Instruction::Apply:
+      --sp;
+      st[sp - 1] = applyOperator(in.kind, st[sp - 1], st[sp]);
+      break;
+    case Instruction::ToBool:
+      st[sp - 1] = st[sp - 1] != 0.0 ? 1.0 : 0.0;
+      break;
+    case Instruction::Jump:
+      pc = in.operand;
+      break;
+    case Instruction::JumpIfFalse:
+      if (st[--sp] == 0.0)
+        pc = in.operand;
+      break;
+    case Instruction::JumpIfFalseOrPop:
+      if (st[sp - 1] == 0.0) {
+        st[sp - 1] = 0.0;
+        pc = in.operand;
+      } else {
+        --sp;
       }
-      // Note: For prefix evaluation (right-to-left token processing),
-      // 'a' is the first operand popped, 'b' is the second.
-      double a_op = st.top(); // Operands are double
-      st.pop();
-      double b_op = st.top();
-      st.pop();
-      if (tok == "+") {
-        st.push(a_op + b_op);
-      } else if (tok == "-") {
-        st.push(a_op - b_op); // a_op is the left operand in infix: a - b
-      } else if (tok == "*") {
-        st.push(a_op * b_op);
-      } else if (tok == "/") {
-        if (b_op == 0.0) {
-          throw std::runtime_error("Division by zero");
-        }
-        st.push(a_op / b_op); // a_op is the dividend: a / b
-      } else if (tok == "^" || tok == "**") {
-        st.push(std::pow(a_op, b_op)); // a_op is the base: a ^ b
+      break;
+    case Instruction::JumpIfTrueOrPop:
+      if (st[sp - 1] != 0.0) {
+        st[sp - 1] = 1.0;
+        pc = in.operand;
       } else {
-        throw std::runtime_error("Unknown operator in prefix expression: " + tok);
+        --sp;
       }
-    } else {
-      throw std::runtime_error("Invalid token in prefix expression: " + tok);
+      break;
+    case Instruction::Call:
+      sp -= in.operand;
+      st[sp] = in.function(st + sp, in.operand);
+      ++sp;
+      break;
     }
   }
-  if (st.size() != 1) {
-    throw std::runtime_error("Invalid prefix expression: The final stack should contain exactly one item.");
-  }
-  return st.top();
+  return st[0];
+}
+
+int ExpressionParser::getArity(const Token &tok) { return arityOf(tok); }
+
+void ExpressionParser::runLimited(const std::function<void()> &work) const {
+  BudgetScope scope(limits);
+  work();
+}
+
+void ExpressionParser::chargeWork(size_t steps) { chargeSteps(steps); }
+
+void ExpressionParser::checkOutputBytes(size_t bytes) const {
+  BudgetScope scope(limits);
+  if (budget)
+    budget->checkOutput(bytes);
+}
+
+std::vector<Token> ExpressionParser::parsePostfix(const std::string &notation,
+                                                  const std::string &expr) const {
+  BudgetScope scope(limits);
+  if (notation == "infix")
+    return infixToPostfixTokens(lexTokens(expr, ParenCalls | ParseNumbers));
+  if (notation == "prefix")
+    return postfixOrder(lexTokens(expr, TaggedCalls | ParseNumbers), notation);
+  if (notation == "postfix")
+    return lexTokens(expr, TaggedCalls | ParseNumbers);
+  throw std::runtime_error("Invalid request: unknown notation '" + notation + "'.");
+}
+
+double ExpressionEvaluator::calcPostfix(const std::string &expr) const {
+  BudgetScope scope(limits);
+  return runCharged(ExpressionProgram::compile(parsePostfix("postfix", expr), "postfix"));
+}
+
+double ExpressionEvaluator::calcPrefix(const std::string &expr) const {
+  BudgetScope scope(limits);
+  return runCharged(ExpressionProgram::compile(parsePostfix("prefix", expr), "prefix"));
 }
 
 double ExpressionEvaluator::calcInfix(const std::string &expr) const {
-  ExpressionConverter conv;
-  std::string postfix = conv.infixToPostfix(expr);
-  return calcPostfix(postfix);
+  BudgetScope scope(limits);
+  return runCharged(ExpressionProgram::compile(parsePostfix("infix", expr), "infix"));
+}
+
+double ExpressionEvaluator::calcPostfix(TokenSpan tokens, const double *slots) const {
+  BudgetScope scope(limits);
+  chargeTokens(tokens.size());
+  return runCharged(ExpressionProgram::compile(tokens, "postfix", slots != nullptr), slots);
+}
+
+double ExpressionEvaluator::calcPrefix(TokenSpan tokens, const double *slots) const {
+  BudgetScope scope(limits);
+  return runCharged(ExpressionProgram::compile(postfixOrder(tokens, "prefix"), "prefix", slots != nullptr),
+                    slots);
+}
+
+double ExpressionEvaluator::calcInfix(TokenSpan tokens, const double *slots) const {
+  BudgetScope scope(limits);
+  return runCharged(ExpressionProgram::compile(infixToPostfixTokens(tokens), "infix", slots != nullptr), slots);
+}
+
+double parseNumber(std::string_view text) {
+  double value = 0.0;
+  auto res = std::from_chars(text.data(), text.data() + text.size(), value);
+  if (res.ec == std::errc::result_out_of_range) {
+    throw std::runtime_error("Number out of range for double: " + std::string(text));
+  }
+  return value;
+}
+
+std::string formatNumber(double value) {
+  char buf[32];
+  return std::string(buf, formatNumber(value, buf, buf + sizeof(buf)));
+}
+
+char *formatNumber(double value, char *first, char *last) {
+  return std::to_chars(first, last, value).ptr;
+}
+
+ExpressionRequestProcessor::ExpressionRequestProcessor(const ExpressionLimits &limits) : limits(limits) {}
+
+void ExpressionRequestProcessor::splitRequest(const std::string &request, std::string &notation,
+                                              std::string &operation, std::string &expr) {
+  // Split off the first two whitespace separated words; the remainder is the
+  // expression itself and may contain any amount of spacing.
+  size_t pos = 0;
+  auto nextWord = [&](const char *what) {
+    while (pos < request.size() && std::isspace((unsigned char)request[pos]))
+      ++pos;
+    size_t start = pos;
+    while (pos < request.size() && !std::isspace((unsigned char)request[pos]))
+      ++pos;
+    if (start == pos) {
+      throw std::runtime_error(std::string("Invalid request: missing ") + what + ".");
+    }
+    return request.substr(start, pos - start);
+  };
+  notation = nextWord("notation");
+  operation = nextWord("operation");
+  expr.assign(request, pos, std::string::npos);
+}
+
+std::string
+ExpressionRequestProcessor::process(const std::string &request) const {
+  std::string out;
+  process(request, out);
+  return out;
+}
+
+void ExpressionRequestProcessor::process(const std::string &request, std::string &out) const {
+  std::string notation, operation, expr;
+  splitRequest(request, notation, operation, expr);
+  process(notation, operation, expr, out);
+}
+
+std::string ExpressionRequestProcessor::process(const std::string &notation,
+                                                const std::string &operation,
+                                                const std::string &expr) const {
+  std::string out;
+  process(notation, operation, expr, out);
+  return out;
+}
+
+void ExpressionRequestProcessor::process(const std::string &notation, const std::string &operation,
+                                         const std::string &expr, std::string &out) const {
+  Result result = run(notation, operation, expr);
+  if (result.evaluated) {
+    char buf[32];
+    out.append(buf, formatNumber(result.value, buf, buf + sizeof(buf)));
+  } else {
+    appendJoined(result.tokens, out);
+  }
+}
+
+size_t ExpressionRequestProcessor::process(const std::string &notation, const std::string &operation,
+                                           const std::string &expr, char *buffer, size_t size) const {
+  Result result = run(notation, operation, expr);
+  if (!result.evaluated)
+    return copyJoined(result.tokens, buffer, size);
+  char buf[32];
+  size_t length = static_cast<size_t>(formatNumber(result.value, buf, buf + sizeof(buf)) - buf);
+  if (length <= size)
+    std::copy(buf, buf + length, buffer);
+  return length;
+}
+
+ExpressionRequestProcessor::Result
+ExpressionRequestProcessor::run(const std::string &notation, const std::string &operation,
+                                const std::string &expr) const {
+  using Conversion = ExpressionConverter::Conversion;
+  BudgetScope scope(limits);
+  Result result;
+  if (notation != "infix" && notation != "postfix" && notation != "prefix") {
+    throw std::runtime_error("Invalid request: unknown notation '" + notation + "'.");
+  }
+  if (operation == "eval") {
+    result.evaluated = true;
+    result.value = notation == "infix"     ? evaluator.calcInfix(expr)
+                   : notation == "postfix" ? evaluator.calcPostfix(expr)
+                                           : evaluator.calcPrefix(expr);
+    return result;
+  }
+  // An empty expression converts to no tokens, so whether the operation is
+  // known is tracked separately.
+  auto &tokens = result.tokens;
+  bool matched = true;
+  if (notation == "infix") {
+    if (operation == "postfix")
+      tokens = converter.convert(Conversion::InfixToPostfix, expr);
+    else if (operation == "prefix")
+      tokens = converter.convert(Conversion::InfixToPrefix, expr);
+    else if (operation == "infix")
+      tokens = converter.postfixToInfixTokens(converter.convert(Conversion::InfixToPostfix, expr), notation);
+    else
+      matched = false;
+  } else if (notation == "postfix") {
+    if (operation == "infix")
+      tokens = converter.convert(Conversion::PostfixToInfix, expr);
+    else if (operation == "prefix")
+      tokens = converter.convert(Conversion::PostfixToPrefix, expr);
+    else if (operation == "postfix")
+      tokens = converter.prefixToPostfixTokens(converter.convert(Conversion::PostfixToPrefix, expr), notation);
+    else
+      matched = false;
+  } else {
+    if (operation == "infix")
+      tokens = converter.convert(Conversion::PrefixToInfix, expr);
+    else if (operation == "postfix")
+      tokens = converter.convert(Conversion::PrefixToPostfix, expr);
+    else if (operation == "prefix")
+      tokens = converter.postfixToPrefixTokens(converter.convert(Conversion::PrefixToPostfix, expr), notation);
+    else
+      matched = false;
+  }
+  if (matched) {
+    checkOutput(tokens);
+    return result;
+  }
+  throw std::runtime_error("Invalid request: unknown operation '" + operation + "'.");
 }
@@ -1,10 +1,19 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <iterator>
 #include <map>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <vector>
 
 template <typename T> bool isNum(const T &expression);
+// Named cell reference: [A-Za-z_][A-Za-z0-9_]*
+template <typename T> bool isIdentifier(const T &expression);
 
 class IOperatorsHandling {
 public:
@@ -13,13 +22,129 @@ public:
   virtual int getOperatorPriority(const std::string &expr) const = 0;
 };
 
+enum class OperatorKind {
+  None, Add, Subtract, Multiply, Divide, Power,
+  Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual, And, Or,
+  Conditional // if(condition, then, otherwise)
+};
+
 class OperatorsHandling : public IOperatorsHandling {
 private:
-  static std::map<std::string, int> operatorsPriority;
+  // std::less<> allows lookups by std::string_view.
+  static std::map<std::string, int, std::less<>> operatorsPriority;
+  static std::map<std::string, OperatorKind, std::less<>> operatorsKind;
 
 public:
   bool isOperator(const std::string &expr) const override;
   int getOperatorPriority(const std::string &expr) const override;
+  int getOperatorPriority(OperatorKind kind) const;
+  OperatorKind getOperatorKind(std::string_view expr) const;
+  // Symbol written for an operator kind, e.g. "**" for Power.
+  static const std::string &getOperatorSymbol(OperatorKind kind);
+};
+
+// Applies a binary operator; throws std::runtime_error on division by zero.
+// Comparisons and logical operators return 1.0 or 0.0.
+double applyOperator(OperatorKind kind, double a, double b);
+
+// Built-in function callable in infix as name(arg, ...). In postfix and
+// prefix a call is written as one token tagged with its argument count,
+// e.g. "max@3" or "sqrt@1". Domain errors such as sqrt(-1) throw
+// std::runtime_error.
+struct MathFunction {
+  using Scalar = double (*)(const double *args, std::uint32_t count);
+  // out[r] = f(columns[0][r], ..., columns[count - 1][r]) for every row r.
+  // 'out' may be columns[0] itself, but no other column.
+  using Batch = void (*)(const double *const *columns, std::uint32_t count,
+                         double *out, size_t rows);
+
+  std::string name;
+  std::uint32_t minArgs;
+  std::uint32_t maxArgs;
+  Scalar call;
+  Batch batch; // Loop written for the compiler to vectorize.
+};
+
+// Returns the built-in function called 'name', or null.
+const MathFunction *findFunction(std::string_view name);
+
+// One token of pre-tokenized input. Code that already holds expressions as
+// token arrays builds these directly and skips lexing, e.g.
+//   {Token::number(2), Token::op(OperatorKind::Add), Token::cell(0, "x")}
+// Tokens made by ExpressionParser::lex keep a view of their source text,
+// which conversions reproduce as written ("2.50" stays "2.50"); that text
+// must outlive the tokens.
+struct Token {
+  enum Type : std::uint8_t {
+    Number, Cell, Operator, Conditional, Call, OpenParen, CloseParen, Comma,
+    Unknown // Unrecognized text; every parser rejects it.
+  };
+
+  Type type = Unknown;
+  OperatorKind kind = OperatorKind::None; // Operator.
+  std::uint32_t arity = 0;                // Call: argument count.
+  std::uint32_t slot = 0;                 // Cell: index into the slots array.
+  double value = 0.0;                     // Number.
+  const MathFunction *function = nullptr; // Call.
+  std::string_view text;                  // Source text, if any.
+
+  static Token number(double value);
+  static Token cell(std::uint32_t slot, std::string_view name = {});
+  static Token op(OperatorKind kind);
+  static Token conditional();
+  // The arity may be left 0 in infix input; conversions fill it in.
+  static Token call(const MathFunction *function, std::uint32_t arity = 0);
+  static Token openParen();
+  static Token closeParen();
+  static Token comma();
+
+  // Calls are written "name@arity", cells without a name "$slot".
+  std::string toString() const;
+};
+
+// Non-owning view of a token array, like C++20 std::span<const Token>. A
+// temporary std::vector<Token> passed as an argument lives long enough.
+class TokenSpan {
+public:
+  TokenSpan(const Token *data, size_t size) : ptr(data), count(size) {}
+  TokenSpan(const std::vector<Token> &tokens) : ptr(tokens.data()), count(tokens.size()) {}
+
+  const Token *begin() const { return ptr; }
+  const Token *end() const { return ptr + count; }
+  const Token &operator[](size_t i) const { return ptr[i]; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+private:
+  const Token *ptr;
+  size_t count;
+};
+
+// Per-call resource limits for untrusted input; 0 means no limit. Each
+// public parse, conversion or evaluation call gets the whole budget. The
+// checks run as the input is read, so an oversized input fails before the
+// work on it is done. Exceeding a limit throws LimitExceeded.
+struct ExpressionLimits {
+  size_t maxInputBytes = 0;
+  size_t maxTokens = 0;
+  // Nesting: open parentheses and pending operators in infix, operands
+  // waiting for an operator in postfix and prefix.
+  size_t maxDepth = 0;
+  size_t maxOutputBytes = 0;
+  // Work units: one per token read, reordered or compiled and one per
+  // instruction executed.
+  size_t maxSteps = 0;
+  std::chrono::microseconds maxTime{0};
+
+  bool unlimited() const {
+    return !maxInputBytes && !maxTokens && !maxDepth && !maxOutputBytes && !maxSteps &&
+           maxTime.count() == 0;
+  }
+};
+
+class LimitExceeded : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
 };
 
 class IExpressionHandling {
@@ -30,6 +155,138 @@ public:
 class ExpressionParser : public IExpressionHandling {
 public:
   OperatorsHandling opHandling;
+  // Applied by every member function; static functions are unlimited.
+  ExpressionLimits limits;
+
+  // Splits an expression into number, cell reference, operator and
+  // parenthesis tokens.
+  static std::vector<std::string> tokenize(const std::string &expr);
+  // Splits an expression into typed tokens whose text points into 'expr'.
+  // Numbers are parsed; cells get slot 0. A name followed by "(" is a call.
+  // Throws std::runtime_error on text that is not a token.
+  static std::vector<Token> lex(const std::string &expr);
+  // Appends the tokens lex() would find starting in [begin, end) when
+  // lexing from 'begin'; the last one may run past 'end'. Unknown tokens
+  // are kept as such. Returns where lexing stopped: past the last token or
+  // at 'end'.
+  static size_t lexRange(const std::string &expr, size_t begin, size_t end, std::vector<Token> &out);
+  // Joins tokens with single spaces. A call followed by "(" is written as
+  // its bare name.
+  static std::string join(TokenSpan tokens);
+  // The same text written through an output iterator; returns the iterator
+  // past the last character.
+  template <typename OutputIt> static OutputIt joinTo(TokenSpan tokens, OutputIt out);
+  // Length of the text join() returns, without building it.
+  static size_t joinedLength(TokenSpan tokens);
+  // Text written for tokens[i]. Returns a view of the token's own text, a
+  // function name or an operator symbol; other spellings are built in
+  // 'scratch'.
+  static std::string_view spelling(TokenSpan tokens, size_t i, std::string &scratch);
+  // Numbers and named cell references.
+  static bool isOperand(const std::string &tok);
+  static bool isCellReference(const std::string &tok);
+  // The conditional "if(condition, then, otherwise)".
+  static bool isConditional(const std::string &tok);
+  // Resolves an arity-tagged call token such as "max@3". Returns null unless
+  // the function exists and accepts that many arguments.
+  static const MathFunction *getCall(const std::string &tok, std::uint32_t &arity);
+  // Operands taken by a token: 0 for operands, 2 for binary operators, 3 for
+  // "if", the tagged count for calls; -1 for anything else.
+  int getArity(const std::string &tok) const;
+  // The same for a typed token; its kind and arity decide, not its text.
+  static int getArity(const Token &tok);
+
+  // Shunting-yard over infix tokens; returns the same tokens in postfix order.
+  std::vector<std::string>
+  infixToPostfixTokens(const std::vector<std::string> &tokens) const;
+  // Reorder tokens between postfix and prefix in linear time. 'notation'
+  // names the input in error messages.
+  std::vector<std::string>
+  postfixToPrefixTokens(const std::vector<std::string> &tokens,
+                        const std::string &notation) const;
+  std::vector<std::string>
+  prefixToPostfixTokens(const std::vector<std::string> &tokens,
+                        const std::string &notation) const;
+
+  // The same steps on typed tokens, with no text in between.
+  std::vector<Token> infixToPostfixTokens(TokenSpan tokens) const;
+  std::vector<Token> postfixToPrefixTokens(TokenSpan tokens, const std::string &notation) const;
+  std::vector<Token> prefixToPostfixTokens(TokenSpan tokens, const std::string &notation) const;
+  // Canonical infix: "( a op b )", "if ( c , a , b )", "max ( a , b )".
+  std::vector<Token> postfixToInfixTokens(TokenSpan tokens, const std::string &notation) const;
+
+  // Parses text written in 'notation' (infix, prefix or postfix) into
+  // postfix tokens with parsed numbers, as the evaluators do. The tokens'
+  // views point into 'expr'.
+  std::vector<Token> parsePostfix(const std::string &notation, const std::string &expr) const;
+
+protected:
+  // The shunting-yard behind infixToPostfixTokens(). 'forPrefix' selects
+  // the wording infixToPrefix has always used for its errors.
+  std::vector<Token> shuntingYard(TokenSpan tokens, bool forPrefix) const;
+
+  // For derived classes that do work of their own between parser calls:
+  // runs 'work' as one limited call, so the parser calls it makes share its
+  // budget. Inside, chargeWork() counts work units against that budget.
+  void runLimited(const std::function<void()> &work) const;
+  static void chargeWork(size_t steps);
+  // Throws LimitExceeded if a result of 'bytes' is over maxOutputBytes.
+  void checkOutputBytes(size_t bytes) const;
+};
+
+template <typename OutputIt>
+OutputIt ExpressionParser::joinTo(TokenSpan tokens, OutputIt out) {
+  std::string scratch;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    if (i > 0)
+      *out++ = ' ';
+    std::string_view piece = spelling(tokens, i, scratch);
+    out = std::copy(piece.begin(), piece.end(), out);
+  }
+  return out;
+}
+
+// Expression compiled to a flat instruction list. '&&', '||' and 'if' become
+// conditional jumps, so an operand whose value is not needed is never
+// evaluated.
+class ExpressionProgram {
+public:
+  struct Instruction {
+    enum Code : std::uint8_t {
+      Push,             // Push 'value'.
+      Load,             // Push slots['operand'].
+      Apply,            // Pop two operands, push 'kind' applied to them.
+      ToBool,           // Replace the top with 1.0 or 0.0.
+      Jump,             // Continue at 'operand'.
+      JumpIfFalse,      // Pop; jump if the value was 0.
+      JumpIfFalseOrPop, // Jump keeping 0 on the stack, otherwise pop.
+      JumpIfTrueOrPop,  // Jump keeping 1 on the stack, otherwise pop.
+      Call              // Pop 'operand' arguments, push 'function' of them.
+    } code;
+    OperatorKind kind;
+    std::uint32_t operand;
+    double value;
+    MathFunction::Scalar function = nullptr; // Resolved when compiling.
+  };
+  // Maps a cell reference to the index of its value in the slots array.
+  using Resolver = std::function<std::uint32_t(const std::string &)>;
+
+  // Compiles tokens in postfix order. Without a resolver, cell references
+  // are rejected. 'notation' names the original input in error messages.
+  static ExpressionProgram compile(const std::vector<std::string> &postfix,
+                                   const std::string &notation = "postfix",
+                                   const Resolver &resolve = nullptr);
+  // Compiles typed tokens in postfix order. Cell tokens load slots[slot];
+  // they are rejected unless 'cellsBound' is set.
+  static ExpressionProgram compile(TokenSpan postfix, const std::string &notation = "postfix",
+                                   bool cellsBound = false);
+  double run(const double *slots = nullptr) const;
+
+  const std::vector<Instruction> &instructions() const { return code; }
+
+private:
+  std::vector<Instruction> code;
+  size_t maxDepth = 0;
 };
 
 class IExpressionConverter : public ExpressionParser {
@@ -40,16 +297,96 @@ public:
   virtual std::string prefixToPostfix(const std::string &expr) const = 0;
   virtual std::string prefixToInfix(const std::string &expr) const = 0;
   virtual std::string postfixToInfix(const std::string &expr) const = 0;
+
+  // Pre-tokenized forms; the results are token arrays as well.
+  virtual std::vector<Token> infixToPrefix(TokenSpan tokens) const = 0;
+  virtual std::vector<Token> postfixToPrefix(TokenSpan tokens) const = 0;
+  virtual std::vector<Token> infixToPostfix(TokenSpan tokens) const = 0;
+  virtual std::vector<Token> prefixToPostfix(TokenSpan tokens) const = 0;
+  virtual std::vector<Token> prefixToInfix(TokenSpan tokens) const = 0;
+  virtual std::vector<Token> postfixToInfix(TokenSpan tokens) const = 0;
 };
 
 class ExpressionConverter : public IExpressionConverter {
 public:
+  enum class Conversion {
+    InfixToPrefix, PostfixToPrefix, InfixToPostfix, PrefixToPostfix, PrefixToInfix, PostfixToInfix
+  };
+
   std::string infixToPrefix(const std::string &expr) const override;
   std::string postfixToPrefix(const std::string &expr) const override;
   std::string infixToPostfix(const std::string &expr) const override;
   std::string prefixToPostfix(const std::string &expr) const override;
   std::string prefixToInfix(const std::string &expr) const override;
   std::string postfixToInfix(const std::string &expr) const override;
+
+  std::vector<Token> infixToPrefix(TokenSpan tokens) const override;
+  std::vector<Token> postfixToPrefix(TokenSpan tokens) const override;
+  std::vector<Token> infixToPostfix(TokenSpan tokens) const override;
+  std::vector<Token> prefixToPostfix(TokenSpan tokens) const override;
+  std::vector<Token> prefixToInfix(TokenSpan tokens) const override;
+  std::vector<Token> postfixToInfix(TokenSpan tokens) const override;
+
+  // The conversions above, writing into caller storage instead of a new
+  // string. On error nothing is written.
+  //  - Through an output iterator; returns the iterator past the end.
+  //  - Appended to 'out', so a string cleared between calls keeps its
+  //    capacity.
+  //  - Into buffer[0, size), without a terminating '\0'. Returns the length
+  //    of the result; if that is more than 'size', nothing is written and
+  //    the caller may retry with a buffer that large.
+  template <typename OutputIt> OutputIt infixToPrefix(const std::string &expr, OutputIt out) const {
+    return joinTo(convert(Conversion::InfixToPrefix, expr), out);
+  }
+  template <typename OutputIt> OutputIt postfixToPrefix(const std::string &expr, OutputIt out) const {
+    return joinTo(convert(Conversion::PostfixToPrefix, expr), out);
+  }
+  template <typename OutputIt> OutputIt infixToPostfix(const std::string &expr, OutputIt out) const {
+    return joinTo(convert(Conversion::InfixToPostfix, expr), out);
+  }
+  template <typename OutputIt> OutputIt prefixToPostfix(const std::string &expr, OutputIt out) const {
+    return joinTo(convert(Conversion::PrefixToPostfix, expr), out);
+  }
+  template <typename OutputIt> OutputIt prefixToInfix(const std::string &expr, OutputIt out) const {
+    return joinTo(convert(Conversion::PrefixToInfix, expr), out);
+  }
+  template <typename OutputIt> OutputIt postfixToInfix(const std::string &expr, OutputIt out) const {
+    return joinTo(convert(Conversion::PostfixToInfix, expr), out);
+  }
+  void infixToPrefix(const std::string &expr, std::string &out) const;
+  void postfixToPrefix(const std::string &expr, std::string &out) const;
+  void infixToPostfix(const std::string &expr, std::string &out) const;
+  void prefixToPostfix(const std::string &expr, std::string &out) const;
+  void prefixToInfix(const std::string &expr, std::string &out) const;
+  void postfixToInfix(const std::string &expr, std::string &out) const;
+  size_t infixToPrefix(const std::string &expr, char *buffer, size_t size) const;
+  size_t postfixToPrefix(const std::string &expr, char *buffer, size_t size) const;
+  size_t infixToPostfix(const std::string &expr, char *buffer, size_t size) const;
+  size_t prefixToPostfix(const std::string &expr, char *buffer, size_t size) const;
+  size_t prefixToInfix(const std::string &expr, char *buffer, size_t size) const;
+  size_t postfixToInfix(const std::string &expr, char *buffer, size_t size) const;
+
+  // Result tokens of a conversion of text; their views point into 'expr'.
+  std::vector<Token> convert(Conversion conversion, const std::string &expr) const;
+
+  // Outputs of convertAll(); combine with '|'.
+  enum Form : unsigned { PrefixForm = 1, PostfixForm = 2, InfixForm = 4, ValueForm = 8 };
+  struct Forms {
+    std::string prefix, postfix, infix; // Empty unless requested.
+    double value = 0.0; // NaN if evaluation failed.
+    std::string error;  // Why evaluation failed; the other forms are still set.
+  };
+  // Parses 'expr', written in 'notation' (infix, prefix or postfix), once
+  // and produces the requested forms from the same postfix tokens. Each
+  // form is what the matching single conversion returns; the infix form is
+  // canonical infix. Throws as that conversion would.
+  Forms convertAll(const std::string &notation, const std::string &expr,
+                   unsigned forms = PrefixForm | PostfixForm | InfixForm) const;
+  // The same into 'out', whose strings keep their capacity between calls.
+  void convertAll(const std::string &notation, const std::string &expr, unsigned forms, Forms &out) const;
+
+private:
+  std::vector<Token> convertTokens(Conversion conversion, const std::string &expr) const;
 };
 
 class IExpressionEvaluator : public ExpressionParser {
@@ -57,6 +394,11 @@ public:
   virtual double calcPrefix(const std::string &expr) const = 0;
   virtual double calcPostfix(const std::string &expr) const = 0;
   virtual double calcInfix(const std::string &expr) const = 0;
+
+  // Pre-tokenized forms. Cell tokens read slots[token.slot].
+  virtual double calcPrefix(TokenSpan tokens, const double *slots = nullptr) const = 0;
+  virtual double calcPostfix(TokenSpan tokens, const double *slots = nullptr) const = 0;
+  virtual double calcInfix(TokenSpan tokens, const double *slots = nullptr) const = 0;
 };
 
 class ExpressionEvaluator : public IExpressionEvaluator {
@@ -64,4 +406,71 @@ public:
   double calcPrefix(const std::string &expr) const override;
   double calcPostfix(const std::string &expr) const override;
   double calcInfix(const std::string &expr) const override;
+
+  double calcPrefix(TokenSpan tokens, const double *slots = nullptr) const override;
+  double calcPostfix(TokenSpan tokens, const double *slots = nullptr) const override;
+  double calcInfix(TokenSpan tokens, const double *slots = nullptr) const override;
+};
+
+// Executes one textual request of the form
+//   "<notation> <operation> <expression>"
+// where <notation> is infix|prefix|postfix and <operation> is
+// infix|prefix|postfix (conversion target) or eval. Returns the converted
+// expression or the evaluated value; throws std::runtime_error on bad input.
+class ExpressionRequestProcessor {
+public:
+  // The limits apply to each request as a whole.
+  explicit ExpressionRequestProcessor(const ExpressionLimits &limits = {});
+
+  std::string process(const std::string &request) const;
+  std::string process(const std::string &notation, const std::string &operation,
+                      const std::string &expr) const;
+
+  // Caller-storage forms, as for ExpressionConverter: appended to 'out',
+  // written through an output iterator, or into buffer[0, size) returning
+  // the length needed.
+  void process(const std::string &request, std::string &out) const;
+  void process(const std::string &notation, const std::string &operation,
+               const std::string &expr, std::string &out) const;
+  template <typename OutputIt>
+  OutputIt process(const std::string &notation, const std::string &operation,
+                   const std::string &expr, OutputIt out) const;
+  size_t process(const std::string &notation, const std::string &operation,
+                 const std::string &expr, char *buffer, size_t size) const;
+
+private:
+  // Conversions produce tokens, evaluations a value.
+  struct Result {
+    std::vector<Token> tokens;
+    double value = 0.0;
+    bool evaluated = false;
+  };
+  Result run(const std::string &notation, const std::string &operation,
+             const std::string &expr) const;
+  static void splitRequest(const std::string &request, std::string &notation,
+                           std::string &operation, std::string &expr);
+
+  ExpressionLimits limits;
+  ExpressionConverter converter;
+  ExpressionEvaluator evaluator;
 };
+
+// Value of a number literal as every parser reads it, whatever the locale.
+// Throws std::runtime_error if it is out of range for a double.
+double parseNumber(std::string_view text);
+// Formats a double using the shortest representation that round-trips.
+std::string formatNumber(double value);
+// The same into [first, last), which must hold 32 characters; returns the
+// end of the text.
+char *formatNumber(double value, char *first, char *last);
+
+template <typename OutputIt>
+OutputIt ExpressionRequestProcessor::process(const std::string &notation,
+                                             const std::string &operation,
+                                             const std::string &expr, OutputIt out) const {
+  Result result = run(notation, operation, expr);
+  if (!result.evaluated)
+    return ExpressionParser::joinTo(result.tokens, out);
+  char buf[32];
+  return std::copy(buf, formatNumber(result.value, buf, buf + sizeof(buf)), out);
+}
@@ -0,0 +1,210 @@
+#include "parallelLexer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+// Runs task(k) for every k in [0, count), one thread each; the last runs on
+// the calling thread. Rethrows the exception of the lowest failing k.
+template <typename Task> void runTasks(size_t count, Task task) {
+  std::vector<std::exception_ptr> errors(count);
+  auto guarded = [&](size_t k) {
+    try {
+      task(k);
+    } catch (...) {
+      errors[k] = std::current_exception();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t k = 0; k + 1 < count; ++k)
+    workers.emplace_back(guarded, k);
+  guarded(count - 1);
+  for (auto &t : workers)
+    t.join();
+  for (auto &e : errors) {
+    if (e)
+      std::rethrow_exception(e);
+  }
+}
+
+struct LexChunk {
+  size_t begin = 0, end = 0;  // Bytes whose tokens this chunk holds.
+  std::vector<Token> tokens;  // Lexed from 'begin', which may be mid-token.
+  size_t stop = 0;            // Where lexing 'tokens' stopped.
+  bool failed = false;        // Lexing from 'begin' threw.
+  std::vector<Token> head;    // Relexed tokens before the first kept one.
+  size_t first = 0;           // First of 'tokens' that is kept.
+  size_t offset = 0;          // Index of 'head' in the result.
+};
+
+// Parentheses of one range of tokens, matched among themselves.
+struct MatchChunk {
+  long depth = 0;                  // Net change of depth over the range.
+  long maxDepth = 0;               // Deepest point, relative to the start.
+  std::vector<size_t> closes;      // ")" without a "(" in the range, in order.
+  std::vector<size_t> opens;       // "(" without a ")" in the range, in order.
+  size_t unknown = LexedExpression::npos; // First unknown token.
+};
+
+size_t position(const Token &tok, const std::string &expr) {
+  return static_cast<size_t>(tok.text.data() - expr.data());
+}
+
+// A "(" that follows a name makes it a call. Inside a chunk the lexer does
+// this itself; at the seams it cannot see the name.
+void markCall(std::vector<Token> &tokens, size_t i) {
+  if (i > 0 && i < tokens.size() && tokens[i].type == Token::OpenParen && tokens[i - 1].type == Token::Cell) {
+    tokens[i - 1].type = Token::Call;
+    tokens[i - 1].function = findFunction(tokens[i - 1].text);
+  }
+}
+
+// Keeps the tokens of each chunk from the first one that starts where the
+// real token sequence also has a token; tokens before that are relexed
+// from where the previous chunk stopped. Serial, but it only touches the
+// few bytes around each boundary.
+void stitch(const std::string &expr, std::vector<LexChunk> &chunks) {
+  size_t resume = 0;
+  for (LexChunk &c : chunks) {
+    c.first = c.tokens.size();
+    if (c.failed) {
+      // Relex the whole chunk so that a real error is thrown in order.
+      resume = ExpressionParser::lexRange(expr, resume, c.end, c.head);
+      continue;
+    }
+    size_t pos = resume, j = 0;
+    while (pos < c.end) {
+      if (std::isspace(static_cast<unsigned char>(expr[pos]))) {
+        ++pos;
+        continue;
+      }
+      while (j < c.tokens.size() && position(c.tokens[j], expr) < pos)
+        ++j;
+      if (j < c.tokens.size() && position(c.tokens[j], expr) == pos) {
+        c.first = j;
+        pos = c.stop;
+        break;
+      }
+      pos = ExpressionParser::lexRange(expr, pos, pos + 1, c.head);
+    }
+    resume = pos;
+  }
+}
+
+MatchChunk matchRange(const std::vector<Token> &tokens, size_t begin, size_t end, std::vector<size_t> &partner) {
+  MatchChunk m;
+  for (size_t i = begin; i < end; ++i) {
+    partner[i] = LexedExpression::npos;
+    switch (tokens[i].type) {
+    case Token::OpenParen:
+      m.opens.push_back(i);
+      m.maxDepth = std::max(m.maxDepth, ++m.depth);
+      break;
+    case Token::CloseParen:
+      --m.depth;
+      if (m.opens.empty()) {
+        m.closes.push_back(i);
+      } else {
+        partner[i] = m.opens.back();
+        partner[m.opens.back()] = i;
+        m.opens.pop_back();
+      }
+      break;
+    case Token::Unknown:
+      if (m.unknown == LexedExpression::npos)
+        m.unknown = i;
+      break;
+    default:
+      break;
+    }
+  }
+  return m;
+}
+} // namespace
+
+ParallelLexer::ParallelLexer(unsigned threads, size_t minChunkBytes)
+    : threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency())),
+      minChunkBytes(std::max<size_t>(1, minChunkBytes)) {}
+
+LexedExpression ParallelLexer::lex(const std::string &expr) const {
+  LexedExpression result;
+  size_t count = std::max<size_t>(1, std::min<size_t>(threads, expr.size() / minChunkBytes));
+
+  // Lex every chunk from its first byte.
+  std::vector<LexChunk> chunks(count);
+  for (size_t k = 0; k < count; ++k) {
+    chunks[k].begin = expr.size() * k / count;
+    chunks[k].end = expr.size() * (k + 1) / count;
+  }
+  runTasks(count, [&](size_t k) {
+    LexChunk &c = chunks[k];
+    try {
+      c.stop = ExpressionParser::lexRange(expr, c.begin, c.end, c.tokens);
+    } catch (const std::runtime_error &) {
+      c.failed = true;
+    }
+  });
+  stitch(expr, chunks);
+
+  // Concatenate, each chunk copying its own part.
+  std::vector<Token> &tokens = result.tokens;
+  size_t total = 0;
+  for (LexChunk &c : chunks) {
+    c.offset = total;
+    total += c.head.size() + (c.tokens.size() - c.first);
+  }
+  if (count == 1) {
+    tokens = std::move(chunks[0].tokens); // Nothing was relexed.
+  } else {
+    tokens.resize(total);
+    runTasks(count, [&](size_t k) {
+      LexChunk &c = chunks[k];
+      auto out = std::copy(c.head.begin(), c.head.end(), tokens.begin() + c.offset);
+      std::copy(c.tokens.begin() + c.first, c.tokens.end(), out);
+      std::vector<Token>().swap(c.tokens);
+    });
+    for (const LexChunk &c : chunks) {
+      markCall(tokens, c.offset);
+      markCall(tokens, c.offset + c.head.size());
+    }
+  }
+
+  // Match parentheses within each range of tokens.
+  std::vector<MatchChunk> ranges(count);
+  result.partner.resize(total);
+  runTasks(count, [&](size_t k) {
+    ranges[k] = matchRange(tokens, total * k / count, total * (k + 1) / count, result.partner);
+  });
+  for (const MatchChunk &m : ranges) {
+    if (m.unknown != LexedExpression::npos) {
+      throw std::runtime_error("Unknown token '" + std::string(tokens[m.unknown].text) + "'.");
+    }
+  }
+
+  // Prefix sum of the ranges' depths; the "(" left open by earlier ranges
+  // close the unmatched ")" of later ones, innermost first.
+  std::vector<size_t> open;
+  long depth = 0;
+  for (const MatchChunk &m : ranges) {
+    for (size_t close : m.closes) {
+      if (open.empty()) {
+        throw std::runtime_error("Invalid infix expression: Mismatched parentheses - no matching '('.");
+      }
+      result.partner[close] = open.back();
+      result.partner[open.back()] = close;
+      open.pop_back();
+    }
+    open.insert(open.end(), m.opens.begin(), m.opens.end());
+    result.maxDepth = std::max(result.maxDepth, static_cast<size_t>(depth + m.maxDepth));
+    depth += m.depth;
+  }
+  if (!open.empty()) {
+    throw std::runtime_error("Invalid infix expression: Mismatched parentheses - unclosed '('.");
+  }
+  return result;
+}
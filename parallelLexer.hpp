@@ -0,0 +1,40 @@
+#pragma once
+
+#include "mathExpressionsHandling.hpp"
+#include <string>
+#include <vector>
+
+// Tokens of one infix expression with its parentheses matched.
+struct LexedExpression {
+  static constexpr size_t npos = static_cast<size_t>(-1);
+
+  std::vector<Token> tokens;   // The same tokens ExpressionParser::lex returns.
+  std::vector<size_t> partner; // Per token: the index of the matching ")" or "(", npos for others.
+  size_t maxDepth = 0;         // Deepest parenthesis nesting.
+};
+
+// Front end for single expressions of many megabytes. The text is split
+// into chunks that are lexed concurrently, each from its first byte. A
+// chunk may start inside a number, a name or "**"; the tokens at each
+// boundary are then relexed from where the previous chunk stopped until
+// they line up with the chunk's own. Parentheses are matched per chunk of
+// tokens in parallel; a prefix sum of each chunk's net depth then places
+// the chunks and pairs the parentheses left open across them.
+//
+// The tokens are ready for infixToPostfixTokens() or calcInfix(), which
+// apply their limits as usual. Those stay serial and match parentheses
+// again; 'partner' and 'maxDepth' are for the caller.
+class ParallelLexer {
+public:
+  // 0 threads means one per core. Each thread gets at least
+  // 'minChunkBytes' of input, so short input is lexed on one.
+  explicit ParallelLexer(unsigned threads = 0, size_t minChunkBytes = 1 << 20);
+
+  // Throws std::runtime_error as lex() does for bad tokens and as the
+  // infix parser does for mismatched parentheses.
+  LexedExpression lex(const std::string &expr) const;
+
+private:
+  unsigned threads;
+  size_t minChunkBytes;
+};
@@ -0,0 +1,607 @@
+// Multi-process evaluator for files with one expression per line.
+//
+// The front process creates a ring of fixed-size slots in POSIX shared
+// memory and starts worker processes that attach to it. One front thread
+// copies input lines into free slots; workers claim slots with an atomic
+// counter, convert or evaluate the expression with ExpressionRequestProcessor
+// and overwrite the slot with the result; the front's main thread collects
+// results in input order and frees the slots again. Slots change hands
+// through one atomic state word each, so no locks, sockets or pipes are
+// involved after start-up.
+//
+// Workers are separate processes for fault isolation. If one dies, the
+// record it was working on is answered with an error line and a replacement
+// worker is started. Further workers may join a running ring with --attach;
+// the front tells whether such a worker is alive by its pid together with
+// its start time, since the pid alone may have been reused.
+//
+// Usage:
+//   shardedEvaluator --from infix|prefix|postfix --to infix|prefix|postfix|eval
+//                    [--workers N] [--slots N] [--slot-size BYTES]
+//                    [--name /SHM_NAME] INPUT [OUTPUT]
+//   shardedEvaluator --attach /SHM_NAME
+// OUTPUT defaults to stdout. Every input line produces one output line;
+// lines that fail produce "error <message>".
+#include "mappedFile.hpp"
+#include "mathExpressionsHandling.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sched.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+              "shared-memory ring needs address-free 64-bit atomics");
+
+constexpr std::uint64_t ringMagic = 0x326e6952726873ULL; // "shrRin2"
+constexpr unsigned maxWorkers = 64;
+
+// A slot's state is (sequence << 2) | phase. Sequence s always uses slot
+// s % slotCount and moves through the phases in order:
+//   Free    - the collector released it for sequence s (initially s = index);
+//   Ready   - the producer wrote expression s into it;
+//   Claimed - a worker (or, as a fallback, the front) is evaluating it;
+//   Done    - the expression was replaced with its result.
+// Ready -> Claimed is a compare-and-swap, so a record is evaluated once
+// even when the front takes over a record whose worker disappeared.
+enum Phase : std::uint64_t { Free = 0, Ready = 1, Claimed = 2, Done = 3 };
+
+enum SlotStatus : std::uint32_t { Ok = 0, Failed = 1, TooLong = 2 };
+
+std::uint64_t state(std::uint64_t sequence, Phase phase) {
+  return (sequence << 2) | phase;
+}
+
+struct SlotHeader {
+  std::atomic<std::uint64_t> state;
+  std::uint32_t length; // Bytes of expression, then of result.
+  std::uint32_t status;
+  // 'slotSize' bytes of data follow.
+};
+
+// Linux pids are below 2^22, which leaves 42 bits of start time: over a
+// thousand years of uptime at 100 ticks a second.
+constexpr unsigned pidBits = 22;
+
+struct WorkerEntry {
+  std::atomic<std::uint64_t> owner;  // workerId() of the process, 0 when the entry is free.
+  std::atomic<std::uint64_t> record; // Sequence taken from 'claimed' + 1, or 0.
+};
+
+// Start time of a live process in clock ticks after boot, or 0 if there is
+// no such process or it has exited and not yet been reaped.
+std::uint64_t startTime(pid_t pid) {
+  std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  // The command name in field 2 is in parentheses and may contain anything.
+  size_t paren = stat.rfind(')');
+  if (paren == std::string::npos)
+    return 0;
+  std::istringstream fields(stat.substr(paren + 1));
+  std::string field;
+  std::uint64_t started = 0;
+  fields >> field; // Field 3, the state.
+  if (field == "Z" || field == "X")
+    return 0;
+  for (int i = 4; i < 22; ++i)
+    fields >> field;
+  fields >> started; // Field 22.
+  return started;
+}
+
+// Names one process for as long as it lives; unlike the pid alone it is
+// never reused.
+std::uint64_t workerId(pid_t pid, std::uint64_t started) {
+  return (started << pidBits) | static_cast<std::uint64_t>(pid);
+}
+
+pid_t workerPid(std::uint64_t id) {
+  return static_cast<pid_t>(id & ((std::uint64_t(1) << pidBits) - 1));
+}
+
+struct RingHeader {
+  std::uint64_t magic;
+  std::uint32_t slotCount;
+  std::uint32_t slotSize;
+  std::uint32_t stride; // Bytes from one slot to the next.
+  char from[16];
+  char to[16];
+  alignas(64) std::atomic<std::uint64_t> claimed;   // Next sequence for workers.
+  alignas(64) std::atomic<std::uint64_t> published; // Sequences written so far.
+  std::atomic<std::uint32_t> closed;                // No more input.
+  alignas(64) WorkerEntry workers[maxWorkers];
+};
+
+size_t headerBytes() { return (sizeof(RingHeader) + 63) / 64 * 64; }
+
+// Shared mapping of the ring, created by the front or attached by a worker.
+class SharedRing {
+public:
+  SharedRing(const std::string &name, std::uint32_t slotCount, std::uint32_t slotSize,
+             const std::string &from, const std::string &to)
+      : name(name), owner(true) {
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+      throw std::runtime_error("Cannot create shared memory " + name + ": " + std::strerror(errno));
+    std::uint32_t stride = static_cast<std::uint32_t>((sizeof(SlotHeader) + slotSize + 63) / 64 * 64);
+    length = headerBytes() + static_cast<size_t>(stride) * slotCount;
+    if (::ftruncate(fd, static_cast<off_t>(length)) < 0) {
+      ::close(fd);
+      ::shm_unlink(name.c_str());
+      throw std::runtime_error("Cannot size shared memory " + name + ": " + std::strerror(errno));
+    }
+    map(fd);
+    header = new (base) RingHeader();
+    header->slotCount = slotCount;
+    header->slotSize = slotSize;
+    header->stride = stride;
+    std::strncpy(header->from, from.c_str(), sizeof(header->from) - 1);
+    std::strncpy(header->to, to.c_str(), sizeof(header->to) - 1);
+    for (std::uint32_t i = 0; i < slotCount; ++i) {
+      SlotHeader *s = new (base + headerBytes() + static_cast<size_t>(stride) * i) SlotHeader();
+      s->state.store(state(i, Free), std::memory_order_relaxed);
+    }
+    // Workers check the magic last, after everything else is in place.
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = ringMagic;
+  }
+
+  explicit SharedRing(const std::string &name) : name(name), owner(false) {
+    int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+      throw std::runtime_error("Cannot open shared memory " + name + ": " + std::strerror(errno));
+    struct stat st;
+    if (::fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < headerBytes()) {
+      ::close(fd);
+      throw std::runtime_error(name + " is not a shardedEvaluator ring");
+    }
+    length = static_cast<size_t>(st.st_size);
+    map(fd);
+    header = reinterpret_cast<RingHeader *>(base);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->magic != ringMagic ||
+        length < headerBytes() + static_cast<size_t>(header->stride) * header->slotCount)
+      throw std::runtime_error(name + " is not a shardedEvaluator ring");
+  }
+
+  ~SharedRing() {
+    ::munmap(base, length);
+    if (owner)
+      ::shm_unlink(name.c_str());
+  }
+
+  SharedRing(const SharedRing &) = delete;
+  SharedRing &operator=(const SharedRing &) = delete;
+
+  RingHeader &head() { return *header; }
+  SlotHeader &slot(std::uint64_t sequence) {
+    size_t index = static_cast<size_t>(sequence % header->slotCount);
+    return *reinterpret_cast<SlotHeader *>(base + headerBytes() + static_cast<size_t>(header->stride) * index);
+  }
+  char *data(SlotHeader &s) { return reinterpret_cast<char *>(&s) + sizeof(SlotHeader); }
+
+private:
+  void map(int fd) {
+    void *p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      if (owner)
+        ::shm_unlink(name.c_str());
+      throw std::runtime_error("Cannot map shared memory " + name + ": " + std::strerror(errno));
+    }
+    base = static_cast<char *>(p);
+  }
+
+  std::string name;
+  bool owner;
+  char *base = nullptr;
+  size_t length = 0;
+  RingHeader *header = nullptr;
+};
+
+// Spins briefly, then yields, then sleeps, so idle waiters cost little CPU
+// while a busy ring hands slots over with no system calls.
+class Backoff {
+public:
+  void pause() {
+    if (rounds < 64) {
+      ++rounds;
+    } else if (rounds < 128) {
+      ++rounds;
+      ::sched_yield();
+    } else {
+      timespec ts{0, 50000};
+      ::nanosleep(&ts, nullptr);
+    }
+  }
+  bool sleeping() const { return rounds >= 128; }
+
+private:
+  unsigned rounds = 0;
+};
+
+bool claim(SlotHeader &s, std::uint64_t sequence) {
+  std::uint64_t expected = state(sequence, Ready);
+  return s.state.compare_exchange_strong(expected, state(sequence, Claimed),
+                                         std::memory_order_acquire);
+}
+
+// Marks a slot whose first 'length' bytes hold the result as done.
+void publish(SlotHeader &s, std::uint64_t sequence, SlotStatus status, size_t length) {
+  s.length = static_cast<std::uint32_t>(length);
+  s.status = status;
+  s.state.store(state(sequence, Done), std::memory_order_release);
+}
+
+void finish(SharedRing &ring, SlotHeader &s, std::uint64_t sequence, SlotStatus status,
+            const std::string &text) {
+  size_t length = std::min<size_t>(text.size(), ring.head().slotSize);
+  std::memcpy(ring.data(s), text.data(), length);
+  publish(s, sequence, status, length);
+}
+
+// Evaluates one claimed record and stores the result in its slot.
+void evaluate(SharedRing &ring, const ExpressionRequestProcessor &processor, SlotHeader &s,
+              std::uint64_t sequence, std::string &expr) {
+  RingHeader &h = ring.head();
+  if (s.status == TooLong) {
+    finish(ring, s, sequence, Failed,
+           "Expression longer than the slot size (" + std::to_string(h.slotSize) + " bytes)");
+    return;
+  }
+  expr.assign(ring.data(s), s.length);
+  if (expr.empty()) {
+    finish(ring, s, sequence, Ok, expr);
+    return;
+  }
+  try {
+    // The result is written straight into the slot; 'expr' holds the input.
+    size_t length = processor.process(h.from, h.to, expr, ring.data(s), h.slotSize);
+    if (length > h.slotSize)
+      finish(ring, s, sequence, Failed,
+             "Result longer than the slot size (" + std::to_string(h.slotSize) + " bytes)");
+    else
+      publish(s, sequence, Ok, length);
+  } catch (const std::exception &e) {
+    finish(ring, s, sequence, Failed, e.what());
+  }
+}
+
+int runWorker(const std::string &name) {
+  SharedRing ring(name);
+  RingHeader &h = ring.head();
+  std::uint64_t started = startTime(::getpid());
+  if (started == 0)
+    throw std::runtime_error("Cannot read the start time of this process from /proc");
+  std::uint64_t id = workerId(::getpid(), started);
+  WorkerEntry *entry = nullptr;
+  for (auto &candidate : h.workers) {
+    std::uint64_t idle = 0;
+    if (candidate.owner.compare_exchange_strong(idle, id)) {
+      entry = &candidate;
+      break;
+    }
+  }
+  if (!entry)
+    throw std::runtime_error("Too many workers attached to " + name);
+
+  ExpressionRequestProcessor processor;
+  std::string expr;
+  for (;;) {
+    // The record is published before 'claimed' moves past it, so the front
+    // never sees a taken sequence that no worker entry names.
+    std::uint64_t sequence = h.claimed.load(std::memory_order_relaxed);
+    do {
+      entry->record.store(sequence + 1, std::memory_order_relaxed);
+    } while (!h.claimed.compare_exchange_weak(sequence, sequence + 1, std::memory_order_release,
+                                              std::memory_order_relaxed));
+    SlotHeader &s = ring.slot(sequence);
+    Backoff backoff;
+    std::uint64_t current;
+    while ((current = s.state.load(std::memory_order_acquire)) < state(sequence, Ready)) {
+      if (h.closed.load(std::memory_order_acquire) &&
+          sequence >= h.published.load(std::memory_order_acquire)) {
+        entry->record.store(0, std::memory_order_relaxed);
+        entry->owner.store(0, std::memory_order_release);
+        return 0;
+      }
+      backoff.pause();
+    }
+
+    // Past Ready means the front took the record over.
+    if (current == state(sequence, Ready) && claim(s, sequence))
+      evaluate(ring, processor, s, sequence, expr);
+    entry->record.store(0, std::memory_order_relaxed);
+  }
+}
+
+struct EvaluatorOptions {
+  std::string from;
+  std::string to;
+  std::string inputPath;
+  std::string outputPath;
+  std::string name;
+  std::string attach;
+  unsigned workers = 0;
+  std::uint32_t slots = 4096;
+  std::uint32_t slotSize = 1024;
+};
+
+EvaluatorOptions parseOptions(int argc, char **argv) {
+  EvaluatorOptions options;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc)
+        throw std::runtime_error("Missing value for " + arg);
+      return argv[++i];
+    };
+    if (arg == "--from") {
+      options.from = value();
+    } else if (arg == "--to") {
+      options.to = value();
+    } else if (arg == "--workers") {
+      options.workers = static_cast<unsigned>(std::stoul(value()));
+    } else if (arg == "--slots") {
+      options.slots = static_cast<std::uint32_t>(std::max(1ul, std::stoul(value())));
+    } else if (arg == "--slot-size") {
+      options.slotSize = static_cast<std::uint32_t>(std::max(16ul, std::stoul(value())));
+    } else if (arg == "--name") {
+      options.name = value();
+    } else if (arg == "--attach") {
+      options.attach = value();
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      throw std::runtime_error("Unknown option " + arg);
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if (!options.attach.empty())
+    return options;
+  if (options.from.empty() || options.to.empty() || positional.empty() || positional.size() > 2)
+    throw std::runtime_error("Usage: shardedEvaluator --from NOTATION --to NOTATION|eval "
+                             "[--workers N] [--slots N] [--slot-size BYTES] [--name /SHM_NAME] "
+                             "INPUT [OUTPUT]\n       shardedEvaluator --attach /SHM_NAME");
+  if (options.from.size() >= sizeof(RingHeader::from) || options.to.size() >= sizeof(RingHeader::to))
+    throw std::runtime_error("Invalid request: unknown notation or operation.");
+  options.inputPath = positional[0];
+  if (positional.size() == 2)
+    options.outputPath = positional[1];
+  if (options.workers == 0)
+    options.workers = std::max(1u, std::thread::hardware_concurrency());
+  options.workers = std::min(options.workers, maxWorkers);
+  if (options.name.empty())
+    options.name = "/shardedEvaluator." + std::to_string(::getpid());
+  return options;
+}
+
+// Starts a worker as a fresh process image, so it is safe to call while the
+// producer thread is running.
+pid_t spawnWorker(const std::string &name) {
+  pid_t pid = ::fork();
+  if (pid < 0)
+    throw std::runtime_error(std::string("fork: ") + std::strerror(errno));
+  if (pid == 0) {
+    ::execl("/proc/self/exe", "shardedEvaluator", "--attach", name.c_str(), static_cast<char *>(nullptr));
+    ::_exit(127);
+  }
+  return pid;
+}
+
+// Answers the record of every worker process that died while evaluating it
+// and starts a replacement for each child that died before the input ran
+// out. Records a dead worker had taken but not yet claimed are picked up by
+// the collector. A child's pid cannot be reused before it is waited for; an
+// attached worker is alive only while its pid has the start time it
+// registered with.
+void reapWorkers(SharedRing &ring, const std::string &name, std::vector<pid_t> &children) {
+  RingHeader &h = ring.head();
+  for (auto &entry : h.workers) {
+    std::uint64_t id = entry.owner.load(std::memory_order_acquire);
+    if (id == 0)
+      continue;
+    pid_t pid = workerPid(id);
+    auto child = std::find(children.begin(), children.end(), pid);
+    bool dead;
+    if (child != children.end()) {
+      int status;
+      dead = ::waitpid(pid, &status, WNOHANG) == pid;
+    } else {
+      dead = workerId(pid, startTime(pid)) != id;
+    }
+    if (!dead)
+      continue;
+    std::uint64_t record = entry.record.load(std::memory_order_acquire);
+    if (record != 0) {
+      std::uint64_t sequence = record - 1;
+      SlotHeader &s = ring.slot(sequence);
+      if (s.state.load(std::memory_order_acquire) == state(sequence, Claimed))
+        finish(ring, s, sequence, Failed,
+               "Worker process " + std::to_string(pid) + " died while evaluating this expression");
+    }
+    entry.record.store(0, std::memory_order_relaxed);
+    entry.owner.store(0, std::memory_order_release);
+    if (child != children.end()) {
+      children.erase(child);
+      if (!h.closed.load(std::memory_order_acquire))
+        children.push_back(spawnWorker(name));
+    }
+  }
+}
+
+// True if no live worker is going to claim 'sequence'; its worker died
+// before claiming it or every worker is gone.
+bool orphaned(RingHeader &h, std::uint64_t sequence) {
+  // Read before the records: a worker names its record before taking it.
+  bool taken = h.claimed.load(std::memory_order_acquire) > sequence;
+  bool anyWorker = false;
+  for (auto &entry : h.workers) {
+    if (entry.owner.load(std::memory_order_acquire) == 0)
+      continue;
+    anyWorker = true;
+    if (entry.record.load(std::memory_order_acquire) == sequence + 1)
+      return false;
+  }
+  return !anyWorker || taken;
+}
+
+void writeAll(int fd, const std::string &text) {
+  size_t done = 0;
+  while (done < text.size()) {
+    ssize_t n = ::write(fd, text.data() + done, text.size() - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw std::runtime_error(std::string("write: ") + std::strerror(errno));
+    done += static_cast<size_t>(n);
+  }
+}
+
+int runFront(const EvaluatorOptions &options) {
+  // Validate the notation pair once up front instead of failing every line.
+  ExpressionRequestProcessor processor;
+  processor.process(options.from, options.to, "1");
+
+  auto start = std::chrono::steady_clock::now();
+  MappedFile input(options.inputPath);
+  int outFd = STDOUT_FILENO;
+  if (!options.outputPath.empty() && options.outputPath != "-") {
+    outFd = ::open(options.outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outFd < 0)
+      throw std::runtime_error("Cannot open " + options.outputPath + ": " + std::strerror(errno));
+  }
+
+  SharedRing ring(options.name, options.slots, options.slotSize, options.from, options.to);
+  RingHeader &h = ring.head();
+  std::vector<pid_t> children;
+  for (unsigned i = 0; i < options.workers; ++i)
+    children.push_back(spawnWorker(options.name));
+
+  // Producer: one line per sequence number, in input order.
+  std::atomic<std::uint64_t> total{0};
+  std::atomic<bool> produced{false};
+  std::atomic<bool> aborted{false};
+  std::thread producer([&] {
+    std::uint64_t sequence = 0;
+    for (const char *p = input.begin(); p < input.end(); ++sequence) {
+      const char *nl = static_cast<const char *>(
+          std::memchr(p, '\n', static_cast<size_t>(input.end() - p)));
+      const char *lineEnd = nl ? nl : input.end();
+      const char *contentEnd = lineEnd;
+      if (contentEnd > p && contentEnd[-1] == '\r')
+        --contentEnd;
+      SlotHeader &s = ring.slot(sequence);
+      Backoff backoff;
+      while (s.state.load(std::memory_order_acquire) != state(sequence, Free)) {
+        if (aborted.load(std::memory_order_relaxed))
+          return;
+        backoff.pause();
+      }
+      size_t length = static_cast<size_t>(contentEnd - p);
+      if (length > h.slotSize) {
+        s.length = 0;
+        s.status = TooLong;
+      } else {
+        std::memcpy(ring.data(s), p, length);
+        s.length = static_cast<std::uint32_t>(length);
+        s.status = Ok;
+      }
+      s.state.store(state(sequence, Ready), std::memory_order_release);
+      h.published.store(sequence + 1, std::memory_order_release);
+      p = nl ? nl + 1 : input.end();
+    }
+    total.store(sequence, std::memory_order_relaxed);
+    produced.store(true, std::memory_order_release);
+    h.closed.store(1, std::memory_order_release);
+  });
+
+  // Collector: results in input order, written in large blocks.
+  std::string out;
+  std::string expr;
+  size_t lines = 0;
+  size_t errors = 0;
+  try {
+    for (std::uint64_t sequence = 0;; ++sequence) {
+      SlotHeader &s = ring.slot(sequence);
+      Backoff backoff;
+      unsigned idle = 0;
+      while (s.state.load(std::memory_order_acquire) != state(sequence, Done)) {
+        if (produced.load(std::memory_order_acquire) && sequence >= total.load(std::memory_order_relaxed))
+          break;
+        backoff.pause();
+        if (backoff.sleeping() && ++idle % 256 == 0) {
+          reapWorkers(ring, options.name, children);
+          if (orphaned(h, sequence) && claim(s, sequence))
+            evaluate(ring, processor, s, sequence, expr);
+        }
+      }
+      if (s.state.load(std::memory_order_acquire) != state(sequence, Done))
+        break;
+      if (s.status != Ok) {
+        out += "error ";
+        ++errors;
+      }
+      out.append(ring.data(s), s.length);
+      out += '\n';
+      ++lines;
+      s.state.store(state(sequence + h.slotCount, Free), std::memory_order_release);
+      if (out.size() >= (1u << 20)) {
+        writeAll(outFd, out);
+        out.clear();
+      }
+    }
+    writeAll(outFd, out);
+  } catch (...) {
+    aborted.store(true);
+    h.closed.store(1, std::memory_order_release);
+    producer.join();
+    throw;
+  }
+  producer.join();
+  for (pid_t pid : children) {
+    int status;
+    ::waitpid(pid, &status, 0);
+  }
+  if (outFd != STDOUT_FILENO)
+    ::close(outFd);
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cerr << std::fixed << std::setprecision(1) << "Evaluated " << lines << " lines ("
+            << errors << " errors) with " << options.workers << " worker processes in "
+            << seconds << " s: " << static_cast<double>(lines) / seconds << " lines/s\n";
+  return errors == 0 ? 0 : 2;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  try {
+    EvaluatorOptions options = parseOptions(argc, argv);
+    if (!options.attach.empty())
+      return runWorker(options.attach);
+    return runFront(options);
+  } catch (const std::exception &e) {
+    std::cerr << "shardedEvaluator: " << e.what() << '\n';
+    return 1;
+  }
+}
@@ -1,13 +1,99 @@
 #include "mathExpressionsHandling.hpp"
+#include "batchEvaluator.hpp"
+#include "expressionCanonicalizer.hpp"
+#include "expressionDag.hpp"
+#include "formulaGraph.hpp"
+#include "parallelLexer.hpp"
 #include "testUtilities.hpp"
+#include <functional>
 #include <iostream>
 #include <vector>
 #include <string> // Required for std::string
 #include <cmath>  // Required for std::abs (used in runTestsNumerical)
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+// Adapters so the DAG can be driven by runTests/runTestsNumerical.
+class DagRoundTrip {
+public:
+  std::string infixToPostfix(const std::string &expr) const { ExpressionDag d; return d.toPostfix(d.addInfix(expr)); }
+  std::string infixToPrefix(const std::string &expr) const { ExpressionDag d; return d.toPrefix(d.addInfix(expr)); }
+  std::string postfixToInfix(const std::string &expr) const { ExpressionDag d; return d.toInfix(d.addPostfix(expr)); }
+  std::string prefixToInfix(const std::string &expr) const { ExpressionDag d; return d.toInfix(d.addPrefix(expr)); }
+  double calcInfix(const std::string &expr) const { ExpressionDag d; return d.evaluate(d.addInfix(expr)); }
+};
+
+// Drives the pre-tokenized overloads from text: lex, convert, join.
+class TokenRoundTrip {
+public:
+  std::string infixToPostfix(const std::string &expr) const { return ExpressionParser::join(converter.infixToPostfix(ExpressionParser::lex(expr))); }
+  std::string infixToPrefix(const std::string &expr) const { return ExpressionParser::join(converter.infixToPrefix(ExpressionParser::lex(expr))); }
+  std::string postfixToInfix(const std::string &expr) const { return ExpressionParser::join(converter.postfixToInfix(ExpressionParser::lex(expr))); }
+  std::string prefixToPostfix(const std::string &expr) const { return ExpressionParser::join(converter.prefixToPostfix(ExpressionParser::lex(expr))); }
+  double calcInfix(const std::string &expr) const { return evaluator.calcInfix(ExpressionParser::lex(expr)); }
+  double calcPrefix(const std::string &expr) const { return evaluator.calcPrefix(ExpressionParser::lex(expr)); }
+
+private:
+  ExpressionConverter converter;
+  ExpressionEvaluator evaluator;
+};
+
+// Lexes on four threads with one-byte chunks, so that nearly every chunk
+// boundary falls inside a token.
+class ParallelRoundTrip {
+public:
+  std::string infixToPostfix(const std::string &expr) const { return ExpressionParser::join(converter.infixToPostfix(lexer.lex(expr).tokens)); }
+  double calcInfix(const std::string &expr) const { return evaluator.calcInfix(lexer.lex(expr).tokens); }
+
+private:
+  ParallelLexer lexer{4, 1};
+  ExpressionConverter converter;
+  ExpressionEvaluator evaluator;
+};
+
+// Starts ./shardedEvaluator with 'args', its diagnostics silenced.
+static pid_t startShardedEvaluator(const std::vector<std::string> &args) {
+  std::vector<char *> argv{const_cast<char *>("shardedEvaluator")};
+  for (const std::string &arg : args)
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  argv.push_back(nullptr);
+  pid_t pid = ::fork();
+  if (pid == 0) {
+    int null = ::open("/dev/null", O_WRONLY);
+    ::dup2(null, STDERR_FILENO);
+    ::execv("./shardedEvaluator", argv.data());
+    ::_exit(127);
+  }
+  return pid;
+}
+
+// The exit status of 'pid', or -1 if it is still running after 'seconds';
+// it is killed then.
+static int waitForExit(pid_t pid, int seconds) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+  int status = 0;
+  while (::waitpid(pid, &status, WNOHANG) == 0) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      ::kill(pid, SIGKILL);
+      ::waitpid(pid, &status, 0);
+      return -1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
 
 int main() {
   ExpressionConverter convertExpr; // For conversion tests
   ExpressionEvaluator evaluator;   // For evaluation tests
+  ExpressionRequestProcessor processor;
+  int sectionFailCounter = 0; // Failed checks of the sections using reportSection.
 
   // --- Test Data: Single Digit ---
   std::vector<std::string> infix_expressions_single_digit = {
@@ -239,6 +325,645 @@ int main() {
   std::cout << "\n[--- Testing calcPrefix (floating point) ---]\n";
   runTestsNumerical(prefix_expected_floating_point, eval_expected_floating_point, &evaluator, &ExpressionEvaluator::calcPrefix);
 
+  // --- Running Comparison, Logical and Conditional Tests ---
+  std::cout << "\n[========== Running Comparison, Logical and Conditional Tests ==========]\n";
+  std::vector<std::string> infix_expressions_logical = {
+      "1 + 2 < 4", "2 * 3 >= 7 || 1 == 1", "1 != 1 && 5 > 4", "if(3 > 2, 10, 20) * 2",
+      "0 && 1/0", "1 || 1/0", "if(0, 1/0, 7) + 1", "if(1 <= 1, if(0, 1, 2), 3)"};
+  std::vector<std::string> postfix_expected_logical = {
+      "1 2 + 4 <", "2 3 * 7 >= 1 1 == ||", "1 1 != 5 4 > &&", "3 2 > 10 20 if 2 *",
+      "0 1 0 / &&", "1 1 0 / ||", "0 1 0 / 7 if 1 +", "1 1 <= 0 1 2 if 3 if"};
+  std::vector<std::string> prefix_expected_logical = {
+      "< + 1 2 4", "|| >= * 2 3 7 == 1 1", "&& != 1 1 > 5 4", "* if > 3 2 10 20 2",
+      "&& 0 / 1 0", "|| 1 / 1 0", "+ if 0 / 1 0 7 1", "if <= 1 1 if 0 1 2 3"};
+  std::vector<std::string> infix_expected_logical_canonical = {
+      "( ( 1 + 2 ) < 4 )", "( ( ( 2 * 3 ) >= 7 ) || ( 1 == 1 ) )", "( ( 1 != 1 ) && ( 5 > 4 ) )",
+      "( if ( ( 3 > 2 ) , 10 , 20 ) * 2 )", "( 0 && ( 1 / 0 ) )", "( 1 || ( 1 / 0 ) )",
+      "( if ( 0 , ( 1 / 0 ) , 7 ) + 1 )", "if ( ( 1 <= 1 ) , if ( 0 , 1 , 2 ) , 3 )"};
+  // '&&', '||' and 'if' skip the operands they do not need, so 1/0 is never run.
+  std::vector<double> eval_expected_logical = {1, 1, 0, 20, 0, 1, 8, 2};
+
+  std::cout << "\n[--- Testing infixToPostfix (logical) ---]\n";
+  runTests(infix_expressions_logical, postfix_expected_logical, &convertExpr, &ExpressionConverter::infixToPostfix);
+  std::cout << "\n[--- Testing infixToPrefix (logical) ---]\n";
+  runTests(infix_expressions_logical, prefix_expected_logical, &convertExpr, &ExpressionConverter::infixToPrefix);
+  std::cout << "\n[--- Testing postfixToInfix (logical) ---]\n";
+  runTests(postfix_expected_logical, infix_expected_logical_canonical, &convertExpr, &ExpressionConverter::postfixToInfix);
+  std::cout << "\n[--- Testing prefixToInfix (logical) ---]\n";
+  runTests(prefix_expected_logical, infix_expected_logical_canonical, &convertExpr, &ExpressionConverter::prefixToInfix);
+  std::cout << "\n[--- Testing prefixToPostfix (logical) ---]\n";
+  runTests(prefix_expected_logical, postfix_expected_logical, &convertExpr, &ExpressionConverter::prefixToPostfix);
+  std::cout << "\n[--- Testing calcInfix (logical) ---]\n";
+  runTestsNumerical(infix_expressions_logical, eval_expected_logical, &evaluator, &ExpressionEvaluator::calcInfix);
+  std::cout << "\n[--- Testing calcPostfix (logical) ---]\n";
+  runTestsNumerical(postfix_expected_logical, eval_expected_logical, &evaluator, &ExpressionEvaluator::calcPostfix);
+  std::cout << "\n[--- Testing calcPrefix (logical) ---]\n";
+  runTestsNumerical(prefix_expected_logical, eval_expected_logical, &evaluator, &ExpressionEvaluator::calcPrefix);
+
+  // --- Running Function Call Tests ---
+  std::cout << "\n[========== Running Function Call Tests ==========]\n";
+  std::vector<std::string> infix_expressions_functions = {
+      "sqrt(16) + 1", "max(1, 2 * 3, 4)", "min(5)", "abs(2 - 7) * 2",
+      "log(exp(2))", "if(max(1, 2) > 1, sqrt(9), 0)"};
+  std::vector<std::string> postfix_expected_functions = {
+      "16 sqrt@1 1 +", "1 2 3 * 4 max@3", "5 min@1", "2 7 - abs@1 2 *",
+      "2 exp@1 log@1", "1 2 max@2 1 > 9 sqrt@1 0 if"};
+  std::vector<std::string> prefix_expected_functions = {
+      "+ sqrt@1 16 1", "max@3 1 * 2 3 4", "min@1 5", "* abs@1 - 2 7 2",
+      "log@1 exp@1 2", "if > max@2 1 2 1 sqrt@1 9 0"};
+  std::vector<std::string> infix_expected_functions_canonical = {
+      "( sqrt ( 16 ) + 1 )", "max ( 1 , ( 2 * 3 ) , 4 )", "min ( 5 )", "( abs ( ( 2 - 7 ) ) * 2 )",
+      "log ( exp ( 2 ) )", "if ( ( max ( 1 , 2 ) > 1 ) , sqrt ( 9 ) , 0 )"};
+  std::vector<double> eval_expected_functions = {5, 6, 5, 10, 2, 3};
+
+  std::cout << "\n[--- Testing infixToPostfix (functions) ---]\n";
+  runTests(infix_expressions_functions, postfix_expected_functions, &convertExpr, &ExpressionConverter::infixToPostfix);
+  std::cout << "\n[--- Testing infixToPrefix (functions) ---]\n";
+  runTests(infix_expressions_functions, prefix_expected_functions, &convertExpr, &ExpressionConverter::infixToPrefix);
+  std::cout << "\n[--- Testing postfixToInfix (functions) ---]\n";
+  runTests(postfix_expected_functions, infix_expected_functions_canonical, &convertExpr, &ExpressionConverter::postfixToInfix);
+  std::cout << "\n[--- Testing prefixToInfix (functions) ---]\n";
+  runTests(prefix_expected_functions, infix_expected_functions_canonical, &convertExpr, &ExpressionConverter::prefixToInfix);
+  std::cout << "\n[--- Testing calcInfix (functions) ---]\n";
+  runTestsNumerical(infix_expressions_functions, eval_expected_functions, &evaluator, &ExpressionEvaluator::calcInfix);
+  std::cout << "\n[--- Testing calcPostfix (functions) ---]\n";
+  runTestsNumerical(postfix_expected_functions, eval_expected_functions, &evaluator, &ExpressionEvaluator::calcPostfix);
+  std::cout << "\n[--- Testing calcPrefix (functions) ---]\n";
+  runTestsNumerical(prefix_expected_functions, eval_expected_functions, &evaluator, &ExpressionEvaluator::calcPrefix);
+
+  // --- Running Pre-tokenized Input Tests ---
+  std::cout << "\n[========== Running Pre-tokenized Input Tests ==========]\n";
+  TokenRoundTrip typed;
+  std::cout << "\n[--- Testing typed infixToPostfix (functions) ---]\n";
+  runTests(infix_expressions_functions, postfix_expected_functions, &typed, &TokenRoundTrip::infixToPostfix);
+  std::cout << "\n[--- Testing typed infixToPrefix (logical) ---]\n";
+  runTests(infix_expressions_logical, prefix_expected_logical, &typed, &TokenRoundTrip::infixToPrefix);
+  std::cout << "\n[--- Testing typed postfixToInfix (floating point) ---]\n";
+  runTests(postfix_expected_floating_point, infix_expected_floating_point_canonical, &typed, &TokenRoundTrip::postfixToInfix);
+  std::cout << "\n[--- Testing typed prefixToPostfix (functions) ---]\n";
+  runTests(prefix_expected_functions, postfix_expected_functions, &typed, &TokenRoundTrip::prefixToPostfix);
+  std::cout << "\n[--- Testing typed calcInfix (multi digit) ---]\n";
+  runTestsNumerical(infix_expressions_multi_digit, eval_expected_multi_digit, &typed, &TokenRoundTrip::calcInfix);
+  std::cout << "\n[--- Testing typed calcPrefix (logical) ---]\n";
+  runTestsNumerical(prefix_expected_logical, eval_expected_logical, &typed, &TokenRoundTrip::calcPrefix);
+
+  // Tokens built by hand, with cells read from a slots array:
+  // max(x, 2) * (y + 1) where x = slots[0], y = slots[1].
+  {
+    std::vector<Token> tokens = {
+        Token::call(findFunction("max")), Token::openParen(), Token::cell(0, "x"), Token::comma(),
+        Token::number(2), Token::closeParen(), Token::op(OperatorKind::Multiply), Token::openParen(),
+        Token::cell(1), Token::op(OperatorKind::Add), Token::number(1), Token::closeParen()};
+    double slots[] = {5.0, 3.0};
+    std::vector<Token> postfix = convertExpr.infixToPostfix(tokens);
+    bool unboundRejected = false;
+    try {
+      evaluator.calcInfix(tokens);
+    } catch (const std::runtime_error &) {
+      unboundRejected = true;
+    }
+    std::vector<std::string> failures;
+    if (evaluator.calcInfix(tokens, slots) != 20.0 || evaluator.calcPostfix(postfix, slots) != 20.0)
+      failures.push_back("evaluation with slots");
+    if (ExpressionParser::join(postfix) != "x 2 max@2 $1 1 + *")
+      failures.push_back("conversion to postfix");
+    if (ExpressionParser::join(convertExpr.postfixToInfix(postfix)) != "( max ( x , 2 ) * ( $1 + 1 ) )")
+      failures.push_back("conversion to infix");
+    if (!unboundRejected)
+      failures.push_back("cells without slots were accepted");
+    sectionFailCounter += reportSection("Hand-built token", failures);
+  }
+
+  // --- Running Caller Storage Output Tests ---
+  std::cout << "\n[========== Running Caller Storage Output Tests ==========]\n";
+  {
+    std::vector<std::string> failures;
+    std::string out = "> ";
+    convertExpr.infixToPostfix("max(1, 2 * 3)", out);
+    if (out != "> 1 2 3 * max@2")
+      failures.push_back("appending to a string");
+
+    std::vector<char> chars;
+    convertExpr.prefixToInfix("+ 1 * 2 3", std::back_inserter(chars));
+    if (std::string(chars.begin(), chars.end()) != "( 1 + ( 2 * 3 ) )")
+      failures.push_back("writing through an output iterator");
+
+    // Too small: reports the length and leaves the buffer alone.
+    char small[4] = {'x', 'x', 'x', 'x'};
+    size_t needed = convertExpr.postfixToPrefix("1 2 +", small, sizeof(small));
+    char large[16];
+    size_t written = convertExpr.postfixToPrefix("1 2 +", large, sizeof(large));
+    if (needed != 5 || small[0] != 'x' || written != 5 || std::string(large, written) != "+ 1 2")
+      failures.push_back("writing into a buffer");
+
+    char value[32];
+    size_t length = processor.process("infix", "eval", "10 / 4", value, sizeof(value));
+    std::string response = "ok ";
+    processor.process("prefix postfix - 7 1", response);
+    if (std::string(value, length) != "2.5" || response != "ok 7 1 -")
+      failures.push_back("request processor output");
+    // An empty expression converts to nothing; an unknown operation is an error.
+    bool unknownRejected = false;
+    try {
+      processor.process("infix", "sideways", "1");
+    } catch (const std::runtime_error &) {
+      unknownRejected = true;
+    }
+    if (processor.process("infix postfix ") != "" || !unknownRejected)
+      failures.push_back("empty expression and unknown operation");
+    sectionFailCounter += reportSection("Caller storage output", failures);
+  }
+
+  // --- Running Request Processor Tests ---
+  std::cout << "\n[========== Running Request Processor Tests ==========]\n";
+  std::vector<std::string> requests = {
+      "infix postfix 2+3*5", "infix prefix (2+3)*4", "infix infix 1+2*3", "infix eval 10.0/4.0 - 0.5",
+      "postfix infix 9 5 - 3 1 - / 2 **", "postfix prefix 100 2.5 8 * /", "postfix eval 2 10 **",
+      "prefix postfix - + 1 * 2 3 / 4 2", "prefix infix * 3.14 + 2.0 1.0", "prefix eval / 7 2",
+      "  infix   eval   (1 + 2) * 3  ", "infix postfix price*(qty+2)", "postfix prefix a_1 b2 ** c -"
+  };
+  std::vector<std::string> requests_expected = {
+      "2 3 5 * +", "* + 2 3 4", "( 1 + ( 2 * 3 ) )", "2",
+      "( ( ( 9 - 5 ) / ( 3 - 1 ) ) ** 2 )", "/ 100 * 2.5 8", "1024",
+      "1 2 3 * + 4 2 / -", "( 3.14 * ( 2.0 + 1.0 ) )", "3.5",
+      "9", "price qty 2 + *", "- ** a_1 b2 c"
+  };
+  std::cout << "\n[--- Testing ExpressionRequestProcessor::process ---]\n";
+  runTests(requests, requests_expected, &processor, &ExpressionRequestProcessor::process);
+
+  // --- Running Expression DAG Tests ---
+  std::cout << "\n[========== Running Expression DAG Tests ==========]\n";
+  DagRoundTrip dag;
+  std::cout << "\n[--- Testing ExpressionDag infix -> postfix (with parentheses) ---]\n";
+  runTests(infix_expressions_with_parentheses, postfix_expected_with_parentheses, &dag, &DagRoundTrip::infixToPostfix);
+  std::cout << "\n[--- Testing ExpressionDag infix -> prefix (floating point) ---]\n";
+  runTests(infix_expressions_floating_point, prefix_expected_floating_point, &dag, &DagRoundTrip::infixToPrefix);
+  std::cout << "\n[--- Testing ExpressionDag postfix -> infix (multi digit) ---]\n";
+  runTests(postfix_expected_multi_digit, infix_expected_multi_digit_canonical, &dag, &DagRoundTrip::postfixToInfix);
+  std::cout << "\n[--- Testing ExpressionDag prefix -> infix (with parentheses) ---]\n";
+  runTests(prefix_expected_with_parentheses, infix_expected_with_parentheses_canonical, &dag, &DagRoundTrip::prefixToInfix);
+  std::cout << "\n[--- Testing ExpressionDag evaluate (floating point) ---]\n";
+  runTestsNumerical(infix_expressions_floating_point, eval_expected_floating_point, &dag, &DagRoundTrip::calcInfix);
+
+  std::cout << "\n[--- Testing ExpressionDag evaluate (logical) ---]\n";
+  runTestsNumerical(infix_expressions_logical, eval_expected_logical, &dag, &DagRoundTrip::calcInfix);
+
+  std::cout << "\n[--- Testing ExpressionDag postfix -> infix (functions) ---]\n";
+  runTests(postfix_expected_functions, infix_expected_functions_canonical, &dag, &DagRoundTrip::postfixToInfix);
+  std::cout << "\n[--- Testing ExpressionDag evaluate (functions) ---]\n";
+  runTestsNumerical(infix_expressions_functions, eval_expected_functions, &dag, &DagRoundTrip::calcInfix);
+
+  // Repeated subexpressions must be stored once: ((1+2)*(1+2))+((1+2)*(1+2))
+  // has the distinct subtrees 1, 2, 1+2, (1+2)*(1+2) and the root.
+  {
+    ExpressionDag shared;
+    ExpressionDag::NodeId root = shared.addInfix("((1+2)*(1+2))+((1+2)*(1+2))");
+    std::vector<std::string> failures;
+    if (shared.size() != 5)
+      failures.push_back(std::to_string(shared.size()) + " nodes instead of 5");
+    if (shared.evaluate(root) != 18.0)
+      failures.push_back("evaluation");
+    if (shared.addPrefix("* + 1 2 + 1 2") != shared.operand(root, 0))
+      failures.push_back("a later expression does not reuse existing nodes");
+    sectionFailCounter += reportSection("DAG sharing", failures);
+  }
+
+  // Every front end reads literals with parseNumber, so values and errors agree.
+  {
+    std::vector<std::string> failures;
+    auto errorOf = [](const std::function<void()> &f) -> std::string {
+      try {
+        f();
+      } catch (const std::runtime_error &e) {
+        return e.what();
+      }
+      return "no error";
+    };
+    std::string huge = "1" + std::string(400, '0');
+    std::string expected = "Number out of range for double: " + huge;
+    ExpressionDag literals;
+    ExpressionCanonicalizer canonicalizer;
+    if (errorOf([&] { evaluator.calcInfix(huge); }) != expected)
+      failures.push_back("evaluator error");
+    if (errorOf([&] { literals.addNumber(huge); }) != expected || errorOf([&] { literals.addPostfix(huge); }) != expected)
+      failures.push_back("DAG error");
+    if (errorOf([&] { canonicalizer.hash("infix", huge); }) != expected)
+      failures.push_back("canonicalizer error");
+    for (const std::string literal : {"2.", ".5", "0.1", "123456789.987654321"}) {
+      double value = parseNumber(literal);
+      if (literals.node(literals.addNumber(literal)).value != value || evaluator.calcInfix(literal) != value)
+        failures.push_back("value of " + literal);
+    }
+    sectionFailCounter += reportSection("Literal parsing", failures);
+  }
+
+  // --- Running Formula Graph Tests ---
+  std::cout << "\n[========== Running Formula Graph Tests ==========]\n";
+  {
+    std::vector<std::string> failures;
+    auto expect = [&](bool ok, const std::string &what) {
+      if (!ok)
+        failures.push_back(what);
+    };
+    FormulaGraph graph;
+    graph.setValue("price", 12.5);
+    graph.setValue("qty", 4);
+    graph.setFormula("subtotal", "price * qty");
+    graph.setFormula("total", "subtotal + shipping");
+    graph.setValue("shipping", 5);
+    graph.setFormula("unrelated", "qty ** 2");
+    expect(graph.recalculate() == 3, "first recalculation evaluates every formula");
+    expect(graph.getValue("total") == 55.0, "total = 12.5 * 4 + 5");
+    graph.setValue("shipping", 7.5);
+    expect(graph.recalculate() == 1, "only 'total' depends on 'shipping'");
+    expect(graph.getValue("total") == 57.5, "total after shipping change");
+    expect(graph.getValue("unrelated") == 16.0, "unaffected cell keeps its value");
+    bool cycleRejected = false;
+    try {
+      graph.setFormula("price", "total / 2");
+    } catch (const std::runtime_error &e) {
+      cycleRejected = std::string(e.what()).find("Circular reference") != std::string::npos;
+    }
+    expect(cycleRejected, "cycle price -> total -> subtotal -> price is rejected");
+    size_t cellCount = graph.size();
+    // A cycle through a new name, a syntax error and a new cell reading itself.
+    std::vector<std::pair<std::string, std::string>> rejected = {
+        {"price", "total / tax"}, {"price", "fresh + ("}, {"loop", "loop * 2"}};
+    for (const auto &[cell, formula] : rejected) {
+      try {
+        graph.setFormula(cell, formula);
+      } catch (const std::runtime_error &) {
+      }
+    }
+    expect(graph.size() == cellCount, "rejected formulas add no cells");
+    std::string wideFormula = "fresh0";
+    for (int i = 1; i < 200; ++i)
+      wideFormula += " + fresh" + std::to_string(i);
+    auto limitedOut = [&](const ExpressionLimits &limits) {
+      graph.limits = limits;
+      try {
+        graph.setFormula("price", wideFormula);
+      } catch (const LimitExceeded &) {
+        return graph.size() == cellCount;
+      }
+      return false;
+    };
+    ExpressionLimits inputLimit, tokenLimit;
+    inputLimit.maxInputBytes = 100;
+    tokenLimit.maxTokens = 100;
+    expect(limitedOut(inputLimit), "formula over the input limit is rejected");
+    expect(limitedOut(tokenLimit), "formula over the token limit is rejected");
+    graph.limits = {};
+    expect(graph.recalculate() == 0 && graph.getValue("price") == 12.5, "limited formulas leave the cell unchanged");
+    expect(graph.recalculate() == 0 && graph.getValue("price") == 12.5, "rejected formula leaves the cell unchanged");
+    graph.setValue("qty", 0);
+    graph.setFormula("ratio", "total / qty");
+    graph.recalculate();
+    bool divisionReported = false;
+    try {
+      graph.getValue("ratio");
+    } catch (const std::runtime_error &e) {
+      divisionReported = std::string(e.what()).find("Division by zero") != std::string::npos;
+    }
+    expect(divisionReported, "evaluation errors are reported per cell");
+
+    graph.setFormula("discount", "if(qty > 0 && total > 50, total / qty, 0)");
+    graph.recalculate();
+    expect(graph.getValue("discount") == 0.0, "conditional formula skips the division when qty is 0");
+
+    sectionFailCounter += reportSection("Formula graph", failures);
+  }
+
+  // --- Running Canonical Form Tests ---
+  std::cout << "\n[========== Running Canonical Form Tests ==========]\n";
+  {
+    ExpressionCanonicalizer canonicalizer;
+    std::vector<std::string> failures;
+    auto sameAs = [&](const std::string &notation, const std::string &expr, const std::string &canonical) {
+      auto result = canonicalizer.canonicalize(notation, expr);
+      auto expected = canonicalizer.canonicalize("infix", canonical);
+      if (result.infix != canonical || result.hash != expected.hash ||
+          canonicalizer.hash(notation, expr) != result.hash)
+        failures.push_back(notation + " '" + expr + "' gave '" + result.infix + "'");
+    };
+    sameAs("infix", "2+3*x", "( 2 + ( 3 * x ) )");
+    sameAs("infix", "( 2 + ( 3 * x ) )", "( 2 + ( 3 * x ) )");
+    sameAs("prefix", "+ 2 * 3 x", "( 2 + ( 3 * x ) )");
+    sameAs("postfix", "x 3.0 * 2. +", "( 2 + ( 3 * x ) )");
+    sameAs("infix", "c + (b + a)", "( ( a + b ) + c )");
+    sameAs("infix", "y == x^2", "( y == ( x ** 2 ) )");
+    sameAs("infix", "max(max(b, .5), a)", "max ( 0.5 , a , b )");
+    sameAs("infix", "1/0 && 0", "( ( 1 / 0 ) && 0 )");
+    if (canonicalizer.hash("infix", "a - b") == canonicalizer.hash("infix", "b - a"))
+      failures.push_back("a - b and b - a must hash differently");
+    if (canonicalizer.hash("infix", "(a * b) + c") == canonicalizer.hash("infix", "a * (b + c)"))
+      failures.push_back("different groupings of different operators must hash differently");
+
+    sectionFailCounter += reportSection("Canonical form", failures);
+  }
+
+  // --- Running Batch Evaluation Tests ---
+  std::cout << "\n[========== Running Batch Evaluation Tests ==========]\n";
+  {
+    BatchEvaluator batch;
+    std::vector<std::string> failures;
+    auto sameValues = [&](const std::string &notation, const std::vector<std::string> &exprs,
+                          const std::vector<double> &expected) {
+      auto result = batch.evaluate(notation, exprs);
+      for (size_t i = 0; i < exprs.size(); ++i) {
+        if (std::abs(result.values[i] - expected[i]) > 1e-9)
+          failures.push_back(notation + " '" + exprs[i] + "' gave " + std::to_string(result.values[i]));
+      }
+      if (!result.errors.empty())
+        failures.push_back(notation + " batch reported " + std::to_string(result.errors.size()) + " errors");
+    };
+    sameValues("infix", infix_expressions_multi_digit, eval_expected_multi_digit);
+    sameValues("infix", infix_expressions_logical, eval_expected_logical);
+    sameValues("prefix", prefix_expected_functions, eval_expected_functions);
+    sameValues("postfix", postfix_expected_floating_point, eval_expected_floating_point);
+    // The first argument is an intermediate column that the result reuses.
+    sameValues("infix", {"max(1 + 2, 4, 0)", "min(2 * 5, 3, 7)", "max(min(9 - 1, 6), 2 ** 3)"}, {4.0, 3.0, 8.0});
+
+    // One shape, so one group; errors stay with their own rows, and errors in
+    // skipped operands are not errors.
+    auto result = batch.evaluate("infix", {"8 / 2 && 1", "1 / 0 && 1", "0 && 1 / 0", "(3 + 1", "6 / 3 && 0"});
+    bool grouped = result.shapes == 2 && result.values[0] == 1.0 && result.values[2] == 0.0 &&
+                   result.values[4] == 0.0 && std::isnan(result.values[1]);
+    bool reported = result.errors.size() == 2 && result.errors[0].first == 1 &&
+                    result.errors[0].second == "Division by zero" && result.errors[1].first == 3;
+    if (!grouped || !reported)
+      failures.push_back("per-row errors in one group");
+    result = batch.evaluate("infix", {"sqrt(4)", "sqrt(0 - 4)", "sqrt(9)"});
+    if (result.values[0] != 2.0 || result.values[2] != 3.0 || result.errors.size() != 1 ||
+        result.errors[0].second != "Square root of a negative number")
+      failures.push_back("domain error in a column kernel");
+
+    sectionFailCounter += reportSection("Batch evaluation", failures);
+  }
+
+  // --- Running Resource Limit Tests ---
+  std::cout << "\n[========== Running Resource Limit Tests ==========]\n";
+  {
+    std::vector<std::string> failures;
+    // Expects 'f' to throw LimitExceeded with a message starting with 'prefix'.
+    auto expectLimit = [&](const std::string &what, const std::string &prefix, const std::function<void()> &f) {
+      try {
+        f();
+        failures.push_back(what + " was not limited");
+      } catch (const LimitExceeded &e) {
+        if (std::string(e.what()).rfind(prefix, 0) != 0)
+          failures.push_back(what + " gave '" + e.what() + "'");
+      } catch (const std::exception &e) {
+        failures.push_back(what + " threw '" + e.what() + "'");
+      }
+    };
+    std::string deep = std::string(200, '(') + "1" + std::string(200, ')');
+    std::string wide = "1";
+    for (int i = 0; i < 2000; ++i)
+      wide += "+1";
+
+    ExpressionEvaluator limited;
+    limited.limits.maxInputBytes = 1000;
+    expectLimit("input bytes", "Input too large", [&] { limited.calcInfix(wide); });
+    limited.limits = {};
+    limited.limits.maxTokens = 100;
+    expectLimit("token count", "Too many tokens", [&] { limited.calcInfix(wide); });
+    expectLimit("typed token count", "Too many tokens",
+                [&] { limited.calcPostfix(ExpressionParser::lex(convertExpr.infixToPostfix(wide))); });
+    limited.limits = {};
+    limited.limits.maxDepth = 64;
+    expectLimit("infix depth", "Expression nested too deeply", [&] { limited.calcInfix(deep); });
+    std::string tall = "1", chain = "1";
+    for (int i = 0; i < 100; ++i) {
+      tall = "1 " + tall + " +";
+      chain = "- 1 " + chain;
+    }
+    expectLimit("prefix depth", "Expression nested too deeply", [&] { limited.calcPrefix(chain); });
+    expectLimit("postfix depth", "Expression nested too deeply", [&] { limited.calcPostfix(tall); });
+    limited.limits = {};
+    limited.limits.maxSteps = 20000;
+    expectLimit("work budget", "Work budget exceeded", [&] { limited.calcInfix(wide + "*" + wide); });
+    bool withinLimits = limited.calcInfix(wide) == 2001.0;
+
+    ExpressionConverter converter;
+    converter.limits.maxOutputBytes = 16;
+    expectLimit("output size", "Output too large", [&] { converter.infixToPrefix("1+2+3+4+5+6+7+8+9"); });
+    bool smallOutput = converter.infixToPrefix("1+2") == "+ 1 2";
+
+    // A processor applies its limits to each request as a whole.
+    ExpressionLimits requestLimits;
+    requestLimits.maxDepth = 64;
+    requestLimits.maxTime = std::chrono::microseconds(1000000);
+    ExpressionRequestProcessor guarded(requestLimits);
+    expectLimit("request depth", "Expression nested too deeply", [&] { guarded.process("infix postfix " + deep); });
+    bool guardedOk = guarded.process("infix eval " + wide) == "2001";
+    // Unlimited instances are unaffected by a limited one on the same thread.
+    bool unaffected = evaluator.calcInfix(deep) == 1.0;
+
+    // The DAG and the canonicalizer parse through the same limited calls.
+    ExpressionDag dag;
+    dag.limits.maxInputBytes = 1000;
+    expectLimit("DAG input bytes", "Input too large", [&] { dag.addInfix(wide); });
+    dag.limits = {};
+    ExpressionDag::NodeId doubled = dag.addNumber("1"), sum = dag.addInfix(wide);
+    for (int i = 0; i < 40; ++i)
+      doubled = dag.addOperator("+", doubled, doubled);
+    dag.limits.maxOutputBytes = 1 << 20;
+    expectLimit("DAG expansion", "Output too large", [&] { dag.toInfix(doubled); });
+    dag.limits.maxSteps = 1000;
+    expectLimit("DAG evaluation", "Work budget exceeded", [&] { dag.evaluate(sum); });
+    bool dagOk = dag.evaluate(doubled) == 1099511627776.0;
+    // Calls are written without their "@N" tag, so a limit equal to the
+    // output fits exactly.
+    ExpressionDag calls;
+    ExpressionDag::NodeId nested = calls.addInfix("max(min(1, 2), max(3, min(4, 5, 6)), sqrt(abs(7)))");
+    std::string nestedInfix = calls.toInfix(nested);
+    calls.limits.maxOutputBytes = nestedInfix.size();
+    try {
+      dagOk = dagOk && calls.toInfix(nested) == nestedInfix;
+    } catch (const LimitExceeded &) {
+      failures.push_back("DAG call expansion within the limit");
+    }
+    calls.limits.maxOutputBytes = nestedInfix.size() - 1;
+    expectLimit("DAG call expansion", "Output too large", [&] { calls.toInfix(nested); });
+    ExpressionCanonicalizer canonicalizer;
+    canonicalizer.limits.maxTokens = 100;
+    expectLimit("canonicalizer tokens", "Too many tokens", [&] { canonicalizer.hash("infix", wide); });
+    // The canonical text is measured before it is written.
+    canonicalizer.limits = {};
+    std::string mixed = "max(x, 2 ** y, if(a && b, 3, 0 - c)) + 1 * 2 + z * z";
+    std::string canonical = canonicalizer.canonicalize("infix", mixed).infix;
+    canonicalizer.limits.maxOutputBytes = canonical.size();
+    try {
+      dagOk = dagOk && canonicalizer.canonicalize("infix", mixed).infix == canonical;
+    } catch (const LimitExceeded &) {
+      failures.push_back("canonical form within the limit");
+    }
+    canonicalizer.limits.maxOutputBytes = canonical.size() - 1;
+    expectLimit("canonical form", "Output too large", [&] { canonicalizer.canonicalize("infix", mixed); });
+
+    if (!withinLimits || !smallOutput || !guardedOk || !unaffected || !dagOk)
+      failures.push_back("calls within the limits");
+    sectionFailCounter += reportSection("Resource limit", failures);
+  }
+
+  // --- Running One-pass Conversion Tests ---
+  std::cout << "\n[========== Running One-pass Conversion Tests ==========]\n";
+  {
+    std::vector<std::string> failures;
+    ExpressionConverter::Forms forms;
+    const unsigned everything = ExpressionConverter::PrefixForm | ExpressionConverter::PostfixForm |
+                                ExpressionConverter::InfixForm | ExpressionConverter::ValueForm;
+    auto checkAll = [&](const std::vector<std::string> &exprs, const std::vector<std::string> &prefix,
+                        const std::vector<std::string> &postfix, const std::vector<std::string> &infix,
+                        const std::vector<double> &values) {
+      for (size_t i = 0; i < exprs.size(); ++i) {
+        convertExpr.convertAll("infix", exprs[i], everything, forms);
+        if (forms.prefix != prefix[i] || forms.postfix != postfix[i] || forms.infix != infix[i] ||
+            std::abs(forms.value - values[i]) > 1e-9 || !forms.error.empty())
+          failures.push_back("'" + exprs[i] + "' gave '" + forms.prefix + "', '" + forms.postfix + "', '" +
+                             forms.infix + "', " + std::to_string(forms.value));
+      }
+    };
+    checkAll(infix_expressions_with_parentheses, prefix_expected_with_parentheses, postfix_expected_with_parentheses,
+             infix_expected_with_parentheses_canonical, eval_expected_with_parentheses);
+    checkAll(infix_expressions_logical, prefix_expected_logical, postfix_expected_logical,
+             infix_expected_logical_canonical, eval_expected_logical);
+    checkAll(infix_expressions_functions, prefix_expected_functions, postfix_expected_functions,
+             infix_expected_functions_canonical, eval_expected_functions);
+
+    // Only the requested forms; other notations; evaluation errors leave the
+    // conversions in place.
+    auto some = convertExpr.convertAll("prefix", "- * 2 x 1", ExpressionConverter::InfixForm);
+    if (some.infix != "( ( 2 * x ) - 1 )" || !some.prefix.empty() || !some.postfix.empty())
+      failures.push_back("requested forms only");
+    convertExpr.convertAll("postfix", "1 0 /", everything, forms);
+    if (forms.prefix != "/ 1 0" || forms.infix != "( 1 / 0 )" || forms.error != "Division by zero" ||
+        !std::isnan(forms.value))
+      failures.push_back("evaluation error");
+    try {
+      convertExpr.convertAll("postfix", "1 +");
+      failures.push_back("'1 +' was accepted");
+    } catch (const std::runtime_error &) {
+    }
+
+    sectionFailCounter += reportSection("One-pass conversion", failures);
+  }
+
+  // --- Running Parallel Lexing Tests ---
+  std::cout << "\n[========== Running Parallel Lexing Tests ==========]\n";
+  ParallelRoundTrip parallel;
+  std::cout << "\n[--- Testing parallel infixToPostfix (functions) ---]\n";
+  runTests(infix_expressions_functions, postfix_expected_functions, &parallel, &ParallelRoundTrip::infixToPostfix);
+  std::cout << "\n[--- Testing parallel calcInfix (floating point) ---]\n";
+  runTestsNumerical(infix_expressions_floating_point, eval_expected_floating_point, &parallel, &ParallelRoundTrip::calcInfix);
+  {
+    std::vector<std::string> failures;
+    ParallelLexer lexer(3, 1);
+    std::string expr = "max(12.5 ** 2, (x_1 + .25)) >= 100 && ((sqrt(16)))";
+    LexedExpression lexed = lexer.lex(expr);
+    std::vector<Token> serial = ExpressionParser::lex(expr);
+    bool same = lexed.tokens.size() == serial.size();
+    for (size_t i = 0; same && i < serial.size(); ++i) {
+      same = lexed.tokens[i].type == serial[i].type && lexed.tokens[i].text == serial[i].text &&
+             lexed.tokens[i].value == serial[i].value && lexed.tokens[i].function == serial[i].function;
+    }
+    if (!same)
+      failures.push_back("tokens differ from ExpressionParser::lex");
+    // The "(" of max is token 1, its ")" token 11; "( ( sqrt ( 16 ) ) )" ends the list.
+    size_t n = lexed.tokens.size();
+    if (lexed.partner[1] != 11 || lexed.partner[11] != 1 || lexed.partner[n - 8] != n - 1 ||
+        lexed.partner[n - 5] != n - 3 || lexed.partner[0] != LexedExpression::npos || lexed.maxDepth != 3)
+      failures.push_back("parenthesis matching");
+
+    auto expectError = [&](const std::string &input, const std::string &message) {
+      try {
+        lexer.lex(input);
+        failures.push_back("'" + input + "' was accepted");
+      } catch (const std::runtime_error &e) {
+        if (e.what() != message)
+          failures.push_back("'" + input + "' gave '" + e.what() + "'");
+      }
+    };
+    expectError("(1 + 2) * (3", "Invalid infix expression: Mismatched parentheses - unclosed '('.");
+    expectError("(1 + 2)) * 3", "Invalid infix expression: Mismatched parentheses - no matching '('.");
+    expectError("1 + 2 $ 3", "Unknown token '$'.");
+
+    sectionFailCounter += reportSection("Parallel lexing", failures);
+  }
+
+  // --- Running Sharded Evaluation Tests ---
+  std::cout << "\n[========== Running Sharded Evaluation Tests ==========]\n";
+  if (::access("./shardedEvaluator", X_OK) != 0) {
+    std::cout << "Sharded evaluation tests: skipped, build ./shardedEvaluator first\n";
+  } else {
+    std::vector<std::string> failures;
+    std::string base = "/tmp/testRunner." + std::to_string(::getpid());
+    std::string input = base + ".in", output = base + ".out", ring = "/testRunner." + std::to_string(::getpid());
+    // Enough lines that a worker attached at the start is still busy when it
+    // is killed.
+    const std::vector<std::string> shapes = {"1 + 2 * 3", "(4 - 1) ** 2 / 3", "1 / 0", "sqrt(16) + abs(2 - 5)",
+                                             "2 +", "if(1 > 2, 3, 4) * max(1, 7, 5)", "x - 1"};
+    std::vector<std::string> expected;
+    {
+      std::ofstream in(input);
+      for (int i = 0; i < 50000; ++i) {
+        std::string line = "(" + shapes[i % shapes.size()] + ") + " + std::to_string(i % 101);
+        in << line << '\n';
+        try {
+          expected.push_back(processor.process("infix", "eval", line));
+        } catch (const std::runtime_error &e) {
+          expected.push_back("error " + std::string(e.what()));
+        }
+      }
+    }
+    // Every line as a single process gives it, except at most the one a
+    // killed worker was evaluating.
+    auto compare = [&](const std::string &run, const std::string &killed) {
+      std::ifstream out(output);
+      std::string line;
+      size_t n = 0, lost = 0;
+      while (std::getline(out, line) && n < expected.size()) {
+        if (line != expected[n] && (killed.empty() || line.rfind(killed, 0) != 0 || ++lost > 1)) {
+          failures.push_back(run + ": line " + std::to_string(n + 1) + " gave '" + line + "'");
+          return;
+        }
+        ++n;
+      }
+      if (n != expected.size() || std::getline(out, line))
+        failures.push_back(run + ": wrong number of lines");
+    };
+
+    int status = waitForExit(startShardedEvaluator({"--from", "infix", "--to", "eval", "--workers", "3",
+                                                    "--slots", "64", input, output}), 120);
+    if (status != 2) // 2: some lines failed, as they should.
+      failures.push_back("three workers exited with " + std::to_string(status));
+    compare("three workers", "");
+
+    // A worker attached from outside is killed and left unreaped: its pid
+    // stays taken by the zombie, and the front must still see it is gone.
+    pid_t front = startShardedEvaluator({"--from", "infix", "--to", "eval", "--workers", "1", "--slots", "16",
+                                         "--name", ring, input, output});
+    for (int i = 0; i < 500 && ::access(("/dev/shm" + ring).c_str(), F_OK) != 0; ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    pid_t attached = startShardedEvaluator({"--attach", ring});
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ::kill(attached, SIGKILL);
+    status = waitForExit(front, 120);
+    waitForExit(attached, 120);
+    if (status != 2)
+      failures.push_back(status < 0 ? std::string("the front hung after a worker was killed")
+                                    : "the front exited with " + std::to_string(status));
+    else
+      compare("killed worker", "error Worker process " + std::to_string(attached) + " died");
+
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+    std::remove(("/dev/shm" + ring).c_str()); // Left behind only if the front was killed.
+    sectionFailCounter += reportSection("Sharded evaluation", failures);
+  }
+
   // --- Running Malformed Input Tests ---
   std::cout << "\n[========== Running Malformed Input Tests ==========]\n";
   int malformedSuccessCounter = 0;
@@ -291,6 +1016,48 @@ int main() {
   testMalformedExpression("..1", expectedErrorSubstringGeneric, "Number starting with multiple dots (..1)");
   // For "1 . 2", tokenizer creates "1", ".", "2". The "." token is rejected.
   testMalformedExpression("1 . 2", expectedErrorSubstringGeneric, "Space separated dot (1 . 2)");
+  testMalformedExpression("foo(1) + 2", "Unknown function 'foo'", "Call to an unknown function");
+  testMalformedExpression("sqrt(4, 9)", "'sqrt' expects 1 argument", "Too many arguments to sqrt");
+  testMalformedExpression("max()", "'max' expects at least 1 argument", "Empty argument list");
+  testMalformedExpression("max(,)", "empty argument", "Only empty arguments");
+  testMalformedExpression("max(1,)", "empty argument", "Empty last argument");
+  testMalformedExpression("max(,1)", "empty argument", "Empty first argument");
+  testMalformedExpression("if(1,,2)", "empty argument", "Empty argument of if");
+
+  {
+    // Each conversion keeps the wording it has always used for bad input.
+    std::vector<std::string> failures;
+    auto expectError = [&](const std::string &name, const std::function<void()> &call, const std::string &message) {
+      try {
+        call();
+        failures.push_back(name + " was accepted");
+      } catch (const std::runtime_error &e) {
+        if (e.what() != message)
+          failures.push_back(name + " gave '" + e.what() + "'");
+      }
+    };
+    expectError("infixToPrefix unclosed", [&] { convertExpr.infixToPrefix("(1 + 2"); },
+                "Invalid infix expression (for prefix conversion): Mismatched parentheses - no matching '('. "
+                "Original ')' was missing.");
+    expectError("infixToPrefix stray", [&] { convertExpr.infixToPrefix("1 + 2)"); },
+                "Invalid infix expression (for prefix conversion): Mismatched parentheses - unclosed '('. "
+                "Original ')' was unclosed.");
+    expectError("infixToPrefix unknown", [&] { convertExpr.infixToPrefix("1 + $"); },
+                "Invalid infix expression (for prefix conversion): Unknown token '$'.");
+    expectError("infixToPostfix unclosed", [&] { convertExpr.infixToPostfix("(1 + 2"); },
+                "Invalid infix expression: Mismatched parentheses - unclosed '('.");
+    expectError("postfixToPrefix", [&] { convertExpr.postfixToPrefix("1 2 3 +"); },
+                "Invalid postfix expression: stack should have one item at the end.");
+    expectError("prefixToPostfix", [&] { convertExpr.prefixToPostfix("+ 1 2 3"); },
+                "Invalid prefix expression: stack should have one item at the end.");
+    expectError("postfixToInfix", [&] { convertExpr.postfixToInfix("1 2 3 +"); },
+                "Invalid postfix expression: The final stack should contain exactly one item.");
+    expectError("prefixToInfix", [&] { convertExpr.prefixToInfix("+ 1 2 3"); },
+                "Invalid prefix expression: The final stack should contain exactly one item.");
+    expectError("calcPrefix", [&] { evaluator.calcPrefix("+ 1 2 3"); },
+                "Invalid prefix expression: The final stack should contain exactly one item.");
+    sectionFailCounter += reportSection("Error wording", failures);
+  }
 
 
   std::cout << "\n[--- Malformed Input Test Summary ---]\n";
@@ -305,11 +1072,11 @@ int main() {
             << (malformedSuccessCounter + malformedFailCounter) << " malformed input tests.\033[97m\n"; // Reset color
 
   std::cout << "\n[========== All Tests Completed ==========]\n";
-  // Check existing test failures (need to adapt if getTotalFailedTests() isn't available)
-  // For now, just consider malformedFailCounter for return status
+  if (sectionFailCounter > 0) {
+      std::cerr << "\n\033[31mOverall: Some section tests failed.\033[97m" << std::endl;
+  }
   if (malformedFailCounter > 0) { 
       std::cerr << "\n\033[31mOverall: Some malformed input tests failed.\033[97m" << std::endl;
-      return 1; // Indicate failure
   }
-  return 0;
+  return sectionFailCounter > 0 || malformedFailCounter > 0 ? 1 : 0;
 }
@@ -1,5 +1,11 @@
 #include "testUtilities.hpp"
 
-// Any other non-template helper functions specific to test utilities 
-// would go here. For now, it's empty as runTests is a template 
-// and its definition is in the header.
+int reportSection(const std::string &name, const std::vector<std::string> &failures) {
+  if (failures.empty()) {
+    std::cout << "\033[32m\n" << name << " tests: passed\033[97m\n";
+  } else {
+    for (const auto &f : failures)
+      std::cout << "\033[31m\n" << name << " test FAILED: " << f << "\033[97m\n";
+  }
+  return static_cast<int>(failures.size());
+}
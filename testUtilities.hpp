@@ -142,4 +142,10 @@ void runTestsNumerical(const std::vector<std::string> &testCases,
   std::cout << "\033[97m"; // Reset color
 }
 
+// Function: reportSection
+// Purpose: Prints the outcome of a test section that collects a description
+// of each failed check: "<name> tests: passed" in green, or every failure in
+// red. Returns the number of failures, for main's exit status.
+int reportSection(const std::string &name, const std::vector<std::string> &failures);
+
 #endif // TEST_UTILITIES_HPP